@@ -1,17 +1,33 @@
 #pragma once
 
+#include "cppsafe/ChangedLines.h"
+#include "cppsafe/FunctionCache.h"
+#include "cppsafe/FunctionRegistry.h"
 #include "cppsafe/Options.h"
 
 #include <clang/AST/Decl.h>
+#include <clang/Basic/SourceLocation.h>
 #include <clang/Sema/Sema.h>
 #include <clang/Sema/SemaConsumer.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Support/Regex.h>
+
+#include <vector>
 
 namespace cppsafe {
 
 class AstConsumer : public clang::SemaConsumer {
 public:
-    explicit AstConsumer(const CppsafeOptions& Options)
+    /// \param FnCache if non-null, functions whose analysis inputs are unchanged replay their cached
+    ///        diagnostics instead of being analyzed again
+    /// \param Registry if non-null, header functions already analyzed by another TU are skipped
+    explicit AstConsumer(
+        const CppsafeOptions& Options, FunctionCache* FnCache = nullptr, FunctionRegistry* Registry = nullptr)
         : Options(Options)
+        , FnCache(FnCache)
+        , Registry(Registry)
+        , HeaderFilter(Options.HeaderFilter)
+        , ExcludePath(Options.ExcludePath)
     {
     }
 
@@ -24,9 +40,26 @@ public:
 private:
     void run(const clang::FunctionDecl* Fn);
 
+    /// Whether functions declared at \p Loc are analyzed, see CppsafeOptions::HeaderFilter.
+    /// The decision is cached per file, since every function of a header asks the same question.
+    bool isOwnedLocation(clang::SourceLocation Loc);
+
+    /// Changed lines of the file of \p Loc, or nullptr if it is unchanged, see CppsafeOptions::Changed.
+    const std::vector<ChangedLines::Range>* getChangedLines(clang::SourceLocation Loc);
+
+    /// Whether \p Fn overlaps a changed line. Always true without CppsafeOptions::Changed.
+    bool isChanged(const clang::FunctionDecl* Fn);
+
 private:
     CppsafeOptions Options;
+    FunctionCache* FnCache;
+    FunctionRegistry* Registry;
     clang::Sema* Sema = nullptr;
+
+    llvm::Regex HeaderFilter;
+    llvm::Regex ExcludePath;
+    llvm::DenseMap<clang::FileID, bool> OwnedFiles;
+    llvm::DenseMap<clang::FileID, const std::vector<ChangedLines::Range>*> ChangedFiles;
 };
 
 }
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+/// Lines added or modified by a patch, per file, see `--diff`.
+class ChangedLines {
+public:
+    /// Inclusive range of lines in the new version of a file.
+    struct Range {
+        unsigned First = 0;
+        unsigned Last = 0;
+    };
+
+    /// Parse a unified diff, e.g. the output of `git diff`. Only `+` lines are changed, context lines
+    /// are not. A deletion changes the lines around it. Removed files are ignored.
+    static llvm::Expected<ChangedLines> parseUnifiedDiff(llvm::StringRef Diff);
+
+    /// Whether \p Path names the file \p DiffName of the diff. Paths of a diff are relative to the
+    /// repository root, so they are matched as a suffix of \p Path.
+    static bool matches(llvm::StringRef Path, llvm::StringRef DiffName);
+
+    /// Sorted, disjoint changed lines of \p Path, or nullptr if the diff does not touch it.
+    const std::vector<Range>* find(llvm::StringRef Path) const;
+
+    static bool overlaps(const std::vector<Range>& Ranges, unsigned First, unsigned Last);
+
+    /// Ordered by file name, so that iterating is deterministic.
+    const std::map<std::string, std::vector<Range>>& getFiles() const { return Files; }
+
+private:
+    std::map<std::string, std::vector<Range>> Files;
+};
+
+}
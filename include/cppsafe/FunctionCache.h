@@ -0,0 +1,121 @@
+#pragma once
+
+#include "cppsafe/lifetime/Lifetime.h"
+#include "cppsafe/util/type.h"
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/Basic/Diagnostic.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+/// A diagnostic of an analyzed function, with its locations as offsets from the start of the function.
+struct FunctionDiag {
+    struct Range {
+        unsigned Begin = 0;
+        unsigned End = 0;
+        bool IsTokenRange = true;
+    };
+
+    clang::DiagnosticsEngine::Level Level = clang::DiagnosticsEngine::Warning;
+    unsigned Offset = 0;
+    std::vector<Range> Ranges;
+    std::string Message;
+};
+
+/// Diagnostics of already analyzed functions of one TU, persisted across runs.
+///
+/// An entry is keyed by a fingerprint of everything the analysis of a function depends on, so
+/// when a TU changes, only the functions whose fingerprint changed are analyzed again.
+/// The file is rewritten with the entries used by the current run only, so it does not grow
+/// with stale functions.
+class FunctionCache {
+public:
+    /// An empty \p Path keeps the entries in memory only, e.g. across reparses of `--serve`.
+    explicit FunctionCache(std::string Path);
+
+    ~FunctionCache() = default;
+
+    DISALLOW_COPY_AND_MOVE(FunctionCache);
+
+    const std::vector<FunctionDiag>* lookup(llvm::StringRef Fingerprint);
+
+    void insert(llvm::StringRef Fingerprint, std::vector<FunctionDiag> Diags);
+
+    /// Drop the entries not used since the last save, and write the rest to the file, if any.
+    void save();
+
+    unsigned getHits() const { return Hits; }
+    unsigned getMisses() const { return Misses; }
+
+    /// Notes that the analysis of a function exceeded its budget. Its diagnostics depend on how far it got, so
+    /// neither the function nor the TU is cached.
+    void noteBudgetExceeded() { BudgetExceeded = true; }
+    bool hasBudgetExceeded() const { return BudgetExceeded; }
+
+private:
+    struct Entry {
+        std::vector<FunctionDiag> Diags;
+        bool Used = false;
+    };
+
+    std::string Path;
+    llvm::StringMap<Entry> Entries;
+
+    unsigned Hits = 0;
+    unsigned Misses = 0;
+    bool BudgetExceeded = false;
+};
+
+/// Fingerprint the analysis input of \p Fn: its source text and body, its own attributes and
+/// contracts, the lifetime contracts of its direct callees, the types of its variables and
+/// expressions with their type categories, and the fields and bases of the records it uses.
+///
+/// Returns std::nullopt if the diagnostics of \p Fn cannot be replayed by offset, e.g. because it
+/// is produced by a macro.
+std::optional<std::string> fingerprintFunction(const clang::FunctionDecl* Fn, clang::ASTContext& Ctx,
+    clang::lifetime::IsConvertibleTy IsConvertible, clang::lifetime::LifetimeReporterBase& Reporter);
+
+/// Records the diagnostics emitted while alive into FunctionDiag of \p Fn, and forwards them to the
+/// original consumer.
+class FunctionDiagRecorder : public clang::DiagnosticConsumer {
+public:
+    FunctionDiagRecorder(clang::DiagnosticsEngine& Diags, const clang::FunctionDecl* Fn);
+
+    ~FunctionDiagRecorder() override;
+
+    DISALLOW_COPY_AND_MOVE(FunctionDiagRecorder);
+
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level Level, const clang::Diagnostic& Info) override;
+
+    /// Returns std::nullopt if some diagnostic lies outside of the function.
+    std::optional<std::vector<FunctionDiag>> takeDiags();
+
+private:
+    std::optional<unsigned> getOffset(clang::SourceLocation Loc) const;
+
+private:
+    clang::DiagnosticsEngine& Diags;
+    clang::DiagnosticConsumer* Target;
+    std::unique_ptr<clang::DiagnosticConsumer> OwnedTarget;
+
+    clang::FileID File;
+    unsigned Begin = 0;
+    unsigned End = 0;
+
+    std::vector<FunctionDiag> Records;
+    bool Replayable = true;
+};
+
+/// Emit cached diagnostics at the current location of \p Fn.
+void replayFunctionDiags(
+    clang::DiagnosticsEngine& Diags, const clang::FunctionDecl* Fn, const std::vector<FunctionDiag>& Records);
+
+}
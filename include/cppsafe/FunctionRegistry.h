@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cppsafe/util/type.h"
+
+#include <clang/AST/Decl.h>
+#include <clang/Basic/SourceManager.h>
+#include <llvm/ADT/StringSet.h>
+
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace cppsafe {
+
+/// Functions defined in headers that were analyzed by some TU of the current run.
+///
+/// Inline functions and template instantiations of a shared header are seen by every TU
+/// including it. Only the first TU to claim such a function analyzes it, so its diagnostics are
+/// reported once per run instead of once per TU. Thread-safe, but the TU claiming a function is
+/// only deterministic if TUs are analyzed in order, and the results of a TU depend on the TUs
+/// before it, so they must not be cached on their own.
+class FunctionRegistry {
+public:
+    FunctionRegistry() = default;
+
+    ~FunctionRegistry() = default;
+
+    DISALLOW_COPY_AND_MOVE(FunctionRegistry);
+
+    /// Returns false if another TU already claimed \p Fn, which is then not analyzed again.
+    /// Functions of the main file are always unclaimed.
+    bool claim(const clang::FunctionDecl* Fn, const clang::SourceManager& SM);
+
+    /// Stable identity of a function across TUs: the file and offset of its definition, and the
+    /// template arguments of it and its enclosing functions. std::nullopt for main file functions.
+    static std::optional<std::string> getIdentity(const clang::FunctionDecl* Fn, const clang::SourceManager& SM);
+
+private:
+    std::mutex Mutex;
+    llvm::StringSet<> Claimed;
+};
+
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include "cppsafe/ChangedLines.h"
+
+#include <memory>
+#include <string>
+
 namespace cppsafe {
 
 struct CppsafeOptions {
@@ -10,6 +15,19 @@ struct CppsafeOptions {
     bool LifetimeDisabled = false;
     bool LifetimeGlobal = false;
     bool LifetimeOutput = false;
+
+    /// Milliseconds the analysis of a function may take before it degrades, 0 means no limit.
+    unsigned FunctionTimeBudget = 0;
+    /// Block visits the analysis of a function may take before it degrades, 0 means no limit.
+    unsigned MaxBlockVisits = 100000;
+
+    /// If non-empty, functions in headers are only analyzed if the header matches this regex.
+    /// Functions in the main file are always analyzed.
+    std::string HeaderFilter;
+    /// Functions in files matching this regex are never analyzed.
+    std::string ExcludePath;
+    /// If set, only functions overlapping a changed line are analyzed.
+    std::shared_ptr<const ChangedLines> Changed;
 };
 
 }
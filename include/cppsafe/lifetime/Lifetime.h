@@ -100,6 +100,10 @@ public:
     virtual void debugPset(SourceRange Range, StringRef Variable, std::string Pset) = 0;
     virtual void debugTypeCategory(SourceRange Range, TypeCategory Category, StringRef Pointee = "") = 0;
 
+    /// The analysis of \p Function exceeded \p Budget, so it either widens the loop at \p Loc or skips the rest of
+    /// the function from \p Loc on.
+    virtual void remarkBudgetExceeded(SourceLocation Loc, StringRef Function, StringRef Budget, bool Skipped) = 0;
+
 private:
     IsCleaningBlockTy IsCleaningBlock;
     CFGPostDomTree PostDom;
@@ -110,14 +114,22 @@ private:
 
 bool isNoopBlock(const CFGBlock& B);
 
+/// Whether runAnalysis checks the body of \p Func at all.
+bool shouldAnalyze(const FunctionDecl* Func);
+
 void runAnalysis(
     const FunctionDecl* Func, ASTContext& Context, LifetimeReporterBase& Reporter, IsConvertibleTy IsConvertible);
 
 // I known it's ugly, but it's fast to implement
+// The Sema is per thread, each thread analyzes one TU at a time.
 gsl::not_null<Sema*> getSema();
 
 void setSema(Sema* S);
 
+/// Drop all caches keyed by AST nodes. Must be called before a thread starts a new TU,
+/// since a new ASTContext may reuse the addresses of the previous one.
+void clearCaches();
+
 } // namespace lifetime
 } // namespace clang
 
@@ -14,7 +14,7 @@
 #ifndef LLVM_CLANG_AST_LIFETIMEATTRDATA_H
 #define LLVM_CLANG_AST_LIFETIMEATTRDATA_H
 
-#include "cppsafe/util/pointer_variant.h"
+#include "cppsafe/lifetime/VariableTable.h"
 
 #include <clang/AST/Decl.h>
 #include <clang/AST/DeclCXX.h>
@@ -28,72 +28,66 @@ class MaterializeTemporaryExpr;
 
 /// This represents an abstract memory location that is used in the lifetime
 /// contract representation.
+///
+/// It is a handle into the VariableTable of the current thread, so copies and
+/// comparisons are cheap. Variables are ordered by the time they were first seen.
 struct ContractVariable {
     explicit ContractVariable(const BindingDecl* VD)
-        : Var(VD)
+        : Id(lifetime::VariableTable::get().getRoot(lifetime::VariableBase(VD)))
     {
     }
 
     ContractVariable(const VarDecl* PVD, int Deref = 0)
-        : Var(PVD)
+        : Id(lifetime::VariableTable::get().getRoot(lifetime::VariableBase(PVD)))
     {
         assert(PVD);
         deref(Deref);
     }
 
     explicit ContractVariable(const Expr* E)
-        : Var(E)
+        : Id(lifetime::VariableTable::get().getRoot(lifetime::VariableBase(E)))
     {
     }
 
     explicit ContractVariable(const RecordDecl* RD)
-        : Var(RD)
+        : Id(lifetime::VariableTable::get().getRoot(lifetime::VariableBase(RD)))
     {
         assert(RD);
     }
 
     static ContractVariable returnVal(const FunctionDecl* FD) { return ContractVariable(FD); }
 
-    bool operator==(const ContractVariable& O) const { return Var == O.Var && FDs == O.FDs; }
+    bool operator==(const ContractVariable& O) const { return Id == O.Id; }
 
     bool operator!=(const ContractVariable& O) const { return !(*this == O); }
 
-    bool operator<(const ContractVariable& O) const
-    {
-        if (Var != O.Var) {
-            return Var < O.Var;
-        }
-        if (FDs.size() != O.FDs.size()) {
-            return FDs.size() < O.FDs.size();
-        }
+    bool operator<(const ContractVariable& O) const { return Id < O.Id; }
 
-        for (auto I = FDs.begin(), J = O.FDs.begin(); I != FDs.end(); ++I, ++J) {
-            if (*I != *J) {
-                return *I < *J;
-            }
-        }
-        return false;
-    }
+    lifetime::VariableTable::Id getId() const { return Id; }
 
-    bool isThisPointer() const { return Var.is<const RecordDecl*>(); }
+    bool isThisPointer() const { return getBase().is<const RecordDecl*>(); }
 
-    bool isParameter() const { return dyn_cast_or_null<ParmVarDecl>(Var.dyn_cast<const VarDecl*>()) != nullptr; }
+    bool isParameter() const { return asParmVarDecl() != nullptr; }
 
-    const ParmVarDecl* asParmVarDecl() const { return dyn_cast_or_null<ParmVarDecl>(Var.dyn_cast<const VarDecl*>()); }
+    const ParmVarDecl* asParmVarDecl() const
+    {
+        return dyn_cast_or_null<ParmVarDecl>(getBase().dyn_cast<const VarDecl*>());
+    }
 
-    const RecordDecl* asThis() const { return Var.dyn_cast<const RecordDecl*>(); }
+    const RecordDecl* asThis() const { return getBase().dyn_cast<const RecordDecl*>(); }
 
-    bool isReturnVal() const { return Var.is<const FunctionDecl*>(); }
+    bool isReturnVal() const { return getBase().is<const FunctionDecl*>(); }
 
-    bool isMemberExpansion() const { return !FDs.empty() && FDs.back() != nullptr; }
+    bool isMemberExpansion() const { return !getPath().empty() && getPath().back() != nullptr; }
 
     // Chain of field accesses starting from VD. Types must match.
-    void addFieldRef(const FieldDecl* FD) { FDs.push_back(FD); }
+    void addFieldRef(const FieldDecl* FD) { Id = lifetime::VariableTable::get().getChild(Id, FD); }
 
     ContractVariable& deref(int Num = 1)
     {
+        auto& Table = lifetime::VariableTable::get();
         while (Num--) {
-            FDs.push_back(nullptr);
+            Id = Table.getChild(Id, nullptr);
         }
         return *this;
     }
@@ -101,9 +95,7 @@ struct ContractVariable {
     ContractVariable derefCopy(int Num = 1) const
     {
         ContractVariable V = *this;
-        while (Num--) {
-            V.FDs.push_back(nullptr);
-        }
+        V.deref(Num);
         return V;
     }
 
@@ -112,11 +104,11 @@ struct ContractVariable {
         auto Ret = *this;
 
         if (const auto* PVD = asParmVarDecl()) {
-            Ret.Var = Derived->getParamDecl(PVD->getFunctionScopeIndex());
+            Ret.setBase(lifetime::VariableBase(Derived->getParamDecl(PVD->getFunctionScopeIndex())));
         } else if (isThisPointer()) {
-            Ret.Var = Derived->getParent();
+            Ret.setBase(lifetime::VariableBase(Derived->getParent()));
         } else if (isReturnVal()) {
-            Ret.Var = Derived->getCanonicalDecl();
+            Ret.setBase(lifetime::VariableBase(Derived->getCanonicalDecl()));
         } else {
             assert(false);
         }
@@ -126,20 +118,27 @@ struct ContractVariable {
 
 private:
     explicit ContractVariable(const FunctionDecl* FD)
-        : Var(FD->getCanonicalDecl())
+        : Id(lifetime::VariableTable::get().getRoot(lifetime::VariableBase(FD->getCanonicalDecl())))
     {
     }
 
 protected:
-    cppsafe::PointerVariant<const VarDecl*, const BindingDecl*, const Expr*, const RecordDecl*, const FunctionDecl*>
-        // NOLINTNEXTLINE(cppcoreguidelines-non-private-member-variables-in-classes)
-        Var;
+    explicit ContractVariable(lifetime::VariableTable::Id Id)
+        : Id(Id)
+    {
+    }
+
+    const lifetime::VariableBase& getBase() const { return lifetime::VariableTable::get().getBase(Id); }
 
     /// Possibly empty list of fields and deref operations on the base.
     /// The First entry is the field on base, next entry is the field inside
     /// there, etc. Null pointers represent a deref operation.
+    const lifetime::SubVarPath& getPath() const { return lifetime::VariableTable::get().getPath(Id); }
+
+    void setBase(const lifetime::VariableBase& Base) { Id = lifetime::VariableTable::get().getWithBase(Id, Base); }
+
     // NOLINTNEXTLINE(cppcoreguidelines-non-private-member-variables-in-classes)
-    llvm::SmallVector<const FieldDecl*, 4> FDs;
+    lifetime::VariableTable::Id Id;
 };
 
 /// A points-to set that can contain the following locations:
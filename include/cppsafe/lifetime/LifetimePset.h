@@ -19,28 +19,33 @@
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/Expr.h>
 #include <fmt/core.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/STLFunctionalExtras.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringExtras.h>
-#include <range/v3/action/push_back.hpp>
-#include <range/v3/algorithm/find_if_not.hpp>
-#include <range/v3/view/reverse.hpp>
 
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <memory_resource>
 #include <optional>
-#include <set>
+#include <utility>
 
 namespace clang::lifetime {
 
-using SubVarPath = llvm::SmallVector<const FieldDecl*, 4>;
-
 /// A Variable can represent a base:
 /// - a local variable: Var contains a non-null VarDecl
 /// - a binding variable: Var contains a non-null BindingDecl
 /// - the this pointer: Var contains a non-null RecordDecl
 /// - temporary: Var contains a non-null MaterializeTemporaryExpr
-/// - the return value of the current function: Var contains a null Expr
-/// plus fields of them (in member FDs).
+/// - the return value of the current function: Var contains a FunctionDecl
+/// plus fields of them (in its path).
 /// And a list of dereference and field select operations that applied
 /// consecutively to the base.
 class Variable : public ContractVariable {
@@ -82,12 +87,14 @@ public:
         : ContractVariable(CV)
     {
         if (asParmVarDecl()) {
-            Var = FD->getParamDecl(asParmVarDecl()->getFunctionScopeIndex());
+            setBase(VariableBase(FD->getParamDecl(asParmVarDecl()->getFunctionScopeIndex())));
         }
     }
 
     static Variable thisPointer(const RecordDecl* RD) { return Variable(RD); }
 
+    static Variable fromId(VariableTable::Id Id) { return Variable(Id); }
+
     /// A variable that represent the return value of the current function.
     static Variable returnVal(const FunctionDecl* FD) { return Variable(ContractVariable::returnVal(FD), nullptr); }
 
@@ -101,23 +108,9 @@ public:
     //   *(*a).b is NOT the subobject of *a
     bool isParent(const Variable& O) const
     {
-        const auto IsPrefixOf = [this](const llvm::SmallVectorImpl<const FieldDecl*>& OtherFDs) {
-            if (OtherFDs.size() < FDs.size()) {
-                return false;
-            }
-            bool HasPtrField = false;
-            for (const auto* FD : OtherFDs) {
-                if (FD && classifyTypeCategory(FD->getType()).isPointer()) {
-                    HasPtrField = true;
-                }
-                // Dereferencing a pointer field, we are no longer in the same object.
-                if (HasPtrField && !FD) {
-                    return false;
-                }
-            }
-            return FDs.end() == std::mismatch(FDs.begin(), FDs.end(), OtherFDs.begin()).first;
-        };
-        return Var == O.Var && IsPrefixOf(O.FDs);
+        auto& Table = VariableTable::get();
+        // Dereferencing a pointer field, we are no longer in the same object.
+        return Table.isPrefixOf(Id, O.Id) && !Table.getInfo(O.Id).DerefsPointerField;
     }
 
     std::optional<const FieldDecl*> getField() const
@@ -126,7 +119,7 @@ public:
             return std::nullopt;
         }
 
-        return FDs.back();
+        return getPath().back();
     }
 
     std::optional<Variable> getParent() const
@@ -136,60 +129,43 @@ public:
         }
 
         auto R = *this;
-        R.FDs.pop_back();
+        R.Id = VariableTable::get().getParent(Id);
         return R;
     }
 
     bool hasStaticLifetime() const
     {
-        if (const auto* VD = Var.dyn_cast<const VarDecl*>()) {
+        if (const auto* VD = asVarDecl()) {
             return VD->hasGlobalStorage();
         }
+        const auto& FDs = getPath();
         return isThisPointer() && !FDs.empty() && llvm::none_of(FDs, [](const FieldDecl* FD) { return FD == nullptr; });
     }
 
     /// Returns QualType of Variable.
     /// \pre !isReturnVal()
-    /// TODO: Should we cache the type instead of calculating?
-    QualType getType() const
-    {
-        int Order = 0;
-        return getTypeAndOrder(Order);
-    }
+    QualType getType() const { return VariableTable::get().getInfo(Id).Type; }
 
     // Return the type of the base object of this variable, ignoring all
     // fields and derefs.
     // \post never returns a null QualType
     QualType getBaseType() const
     {
-        if (const auto* VD = asVarDecl()) {
-            return VD->getType();
-        }
-        if (const auto* BD = asBindingDecl()) {
-            return BD->getType();
-        }
-        if (const MaterializeTemporaryExpr* MT = asTemporary()) {
-            return MT->getType();
-        }
-        if (const RecordDecl* RD = asThis()) {
-            return RD->getASTContext().getPointerType(RD->getASTContext().getRecordType(RD));
-        }
-        if (const auto* E = Var.dyn_cast<const Expr*>()) {
-            return E->getType();
-        }
-        if (const auto* FD = Var.dyn_cast<const FunctionDecl*>()) {
-            return FD->getReturnType();
-        }
-
-        CPPSAFE_ASSERT(!"Invalid state");
+        auto& Table = VariableTable::get();
+        return Table.getInfo(Table.getBaseId(Id)).Type;
     }
 
-    bool isField() const { return !FDs.empty() && FDs.back(); }
+    bool isField() const { return isMemberExpansion(); }
 
     bool isThisPointer() const { return asThis(); }
 
     bool isTemporary() const { return asTemporary(); }
 
+    const MaterializeTemporaryExpr* asTemporary() const
+    {
+        return dyn_cast_or_null<MaterializeTemporaryExpr>(getBase().dyn_cast<const Expr*>());
+    }
+
     /// When VD is non-null, returns true if the Variable represents a
     /// lifetime-extended temporary that is extended by VD. When VD is null,
     /// returns true if the the Variable is a non-lifetime-extended temporary.
@@ -198,11 +174,11 @@ public:
         return asTemporary() && asTemporary()->getExtendingDecl() == VD;
     }
 
-    const VarDecl* asVarDecl() const { return Var.dyn_cast<const VarDecl*>(); }
+    const VarDecl* asVarDecl() const { return getBase().dyn_cast<const VarDecl*>(); }
 
     const Expr* asExpr() const
     {
-        const auto* E = Var.dyn_cast<const Expr*>();
+        const auto* E = getBase().dyn_cast<const Expr*>();
         if (!E || isa<MaterializeTemporaryExpr>(E)) {
             return nullptr;
         }
@@ -213,7 +189,7 @@ public:
     void addFieldRefUnchecked(const FieldDecl* FD)
     {
         assert(FD);
-        FDs.push_back(FD);
+        ContractVariable::addFieldRef(FD);
     }
 
     void addFieldRef(const FieldDecl* FD)
@@ -234,7 +210,7 @@ public:
         assert(FD->getParent() == RD || RD->isDerivedFrom(dyn_cast<CXXRecordDecl>(FD->getParent()))
             || dyn_cast<CXXRecordDecl>(FD->getParent())->isDerivedFrom(RD));
 #endif
-        FDs.push_back(FD);
+        ContractVariable::addFieldRef(FD);
     }
 
     // replace the expr part to `V`
@@ -242,43 +218,36 @@ public:
     {
         CPPSAFE_ASSERT(asExpr() || isReturnVal());
 
-        auto Ret = V;
-        ranges::actions::push_back(Ret.FDs, FDs);
-        return Ret;
+        return V.chainFields(getPath());
     }
 
     Variable chainFields(const SubVarPath& Path) const
     {
         auto Ret = *this;
-        ranges::actions::push_back(Ret.FDs, Path);
+        auto& Table = VariableTable::get();
+        for (const auto* FD : Path) {
+            Ret.Id = Table.getChild(Ret.Id, FD);
+        }
         return Ret;
     }
 
-    const SubVarPath& getSubVarPath() const { return FDs; }
+    const SubVarPath& getSubVarPath() const { return getPath(); }
 
     Variable& deref(int Num = 1)
     {
-        while (Num--) {
-            FDs.push_back(nullptr);
-        }
+        ContractVariable::deref(Num);
         return *this;
     }
 
-    bool isDeref() const { return !FDs.empty() && FDs.front() == nullptr; }
+    bool isDeref() const { return !getPath().empty() && getPath().front() == nullptr; }
 
     unsigned getOrder() const
     {
-        int Order = -1;
-        getTypeAndOrder(Order);
+        const int Order = VariableTable::get().getInfo(Id).Order;
         return Order >= 0 ? Order : 0;
     }
 
-    unsigned getDerefNum() const
-    {
-        const auto Rev = ranges::views::reverse(FDs);
-        const auto It = ranges::find_if_not(Rev, [](const auto* F) { return F == nullptr; });
-        return It - Rev.begin();
-    }
+    unsigned getDerefNum() const { return VariableTable::get().getInfo(Id).DerefNum; }
 
     std::string getName() const
     {
@@ -297,12 +266,13 @@ public:
             Ret = "this";
         } else if (isReturnVal()) {
             Ret = "(return value)";
-        } else if (const auto* E = Var.dyn_cast<const Expr*>()) {
+        } else if (const auto* E = getBase().dyn_cast<const Expr*>()) {
             Ret = fmt::format("(expr[{}-{}])", E->getStmtClassName(), static_cast<const void*>(E));
         } else {
             CPPSAFE_ASSERT(!"Invalid state");
         }
 
+        const auto& FDs = getPath();
         for (unsigned I = 0; I < FDs.size(); ++I) {
             if (FDs[I]) {
                 if (I > 0 && !FDs[I - 1]) {
@@ -323,42 +293,13 @@ private:
     {
     }
 
-    QualType getTypeAndOrder(int& Order) const
+    explicit Variable(VariableTable::Id Id)
+        : ContractVariable(Id)
     {
-        Order = -1;
-        QualType Base = getBaseType();
-
-        if (classifyTypeCategory(Base) == TypeCategory::Owner) {
-            Order = 0;
-        }
-
-        for (const auto* FD : FDs) {
-            if (FD) {
-                Base = FD->getType();
-                if (Order == -1 && classifyTypeCategory(Base) == TypeCategory::Owner) {
-                    Order = 0;
-                }
-            } else {
-                // Dereference the current pointer/owner
-                // consider: ****v
-                if (!Base.isNull()) {
-                    Base = getPointeeType(Base);
-                }
-
-                if (Order >= 0) {
-                    ++Order;
-                }
-            }
-        }
-        return Base;
     }
 
-    const BindingDecl* asBindingDecl() const { return Var.dyn_cast<const BindingDecl*>(); }
+    const BindingDecl* asBindingDecl() const { return getBase().dyn_cast<const BindingDecl*>(); }
 
-    const MaterializeTemporaryExpr* asTemporary() const
-    {
-        return dyn_cast_or_null<MaterializeTemporaryExpr>(Var.dyn_cast<const Expr*>());
-    }
 };
 
 /// The reason why a pset became invalid
@@ -496,6 +437,362 @@ public:
     }
 };
 
+/// A list of reasons whose first one is stored inline and the others in an immutable, shared tail.
+///
+/// Reasons are only read when a warning is emitted, but psets are copied and merged all the time. Most psets
+/// have a single reason, which costs no allocation. Copies share the tail, and the rare changes build a new one.
+template <class T> class ReasonList {
+    struct Node : llvm::RefCountedBase<Node> {
+        SmallVector<T, 1> Reasons;
+    };
+
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() = default;
+        const_iterator(const ReasonList* List, std::size_t I)
+            : List(List)
+            , I(I)
+        {
+        }
+
+        const T& operator*() const { return I == 0 ? *List->First : List->Rest->Reasons[I - 1]; }
+        const T* operator->() const { return &**this; }
+
+        const_iterator& operator++()
+        {
+            ++I;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto Ret = *this;
+            ++*this;
+            return Ret;
+        }
+
+        bool operator==(const const_iterator& O) const { return I == O.I; }
+
+    private:
+        const ReasonList* List = nullptr;
+        std::size_t I = 0;
+    };
+
+    ReasonList() = default;
+
+    explicit ReasonList(const T& Reason)
+        : First(Reason)
+    {
+    }
+
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, size() }; }
+    std::size_t size() const { return !First ? 0 : 1 + (Rest ? Rest->Reasons.size() : 0); }
+    bool empty() const { return !First; }
+
+    void push_back(const T& R)
+    {
+        if (!First) {
+            First = R;
+            return;
+        }
+
+        auto* N = new Node;
+        if (Rest) {
+            N->Reasons.reserve(Rest->Reasons.size() + 1);
+            N->Reasons.append(Rest->Reasons.begin(), Rest->Reasons.end());
+        }
+        N->Reasons.push_back(R);
+        Rest = N;
+    }
+
+    void clear()
+    {
+        First.reset();
+        Rest = nullptr;
+    }
+
+    /// Apply \p F to every reason. The tail is only rebuilt if \p F changes one of its reasons, which it reports
+    /// by returning true.
+    template <class Fn> void update(const Fn& F)
+    {
+        if (!First) {
+            return;
+        }
+        F(*First);
+        if (!Rest) {
+            return;
+        }
+
+        const ArrayRef<T> Reasons = Rest->Reasons;
+        for (std::size_t I = 0; I < Reasons.size(); ++I) {
+            auto R = Reasons[I];
+            if (!F(R)) {
+                continue;
+            }
+
+            auto* N = new Node;
+            N->Reasons.assign(Reasons.begin(), Reasons.end());
+            N->Reasons[I] = R;
+            for (++I; I < Reasons.size(); ++I) {
+                F(N->Reasons[I]);
+            }
+            Rest = N;
+            return;
+        }
+    }
+
+private:
+    std::optional<T> First;
+    llvm::IntrusiveRefCntPtr<const Node> Rest;
+};
+
+/// The variables of a pset, as a bit vector over their ids.
+///
+/// Ids are handed out in the order variables are first seen, so the variables of a pset mostly have
+/// close ids. Only the non-zero 64-bit words are stored, sorted by their index, the first one inline.
+/// Merging, comparing and inclusion are word-wise loops. Iterating yields the variables by value,
+/// ordered by id.
+class VariableSet {
+    using Word = std::uint64_t;
+    static constexpr unsigned WordBits = 64;
+
+    struct Block {
+        VariableTable::Id Index;
+        Word Bits;
+
+        bool operator==(const Block& O) const = default;
+    };
+
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Variable;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Variable;
+
+        struct ArrowProxy {
+            Variable V;
+
+            const Variable* operator->() const { return &V; }
+        };
+
+        Variable operator*() const
+        {
+            return Variable::fromId(It->Index * WordBits + static_cast<unsigned>(std::countr_zero(Rest)));
+        }
+
+        ArrowProxy operator->() const { return { **this }; }
+
+        const_iterator& operator++()
+        {
+            Rest &= Rest - 1;
+            if (Rest == 0) {
+                ++It;
+                Rest = It != End ? It->Bits : 0;
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto Ret = *this;
+            ++*this;
+            return Ret;
+        }
+
+        bool operator==(const const_iterator& O) const { return It == O.It && Rest == O.Rest; }
+
+    private:
+        friend class VariableSet;
+
+        const_iterator(const Block* It, const Block* End)
+            : It(It)
+            , End(End)
+            , Rest(It != End ? It->Bits : 0)
+        {
+        }
+
+        const Block* It;
+        const Block* End;
+        /// Bits of *It that are not visited yet
+        Word Rest;
+    };
+
+    using iterator = const_iterator;
+
+    const_iterator begin() const { return { Blocks.begin(), Blocks.end() }; }
+    const_iterator end() const { return { Blocks.end(), Blocks.end() }; }
+
+    bool empty() const { return Blocks.empty(); }
+
+    std::size_t size() const
+    {
+        std::size_t Size = 0;
+        for (const auto& B : Blocks) {
+            Size += static_cast<std::size_t>(std::popcount(B.Bits));
+        }
+        return Size;
+    }
+
+    bool operator==(const VariableSet& O) const { return Blocks == O.Blocks; }
+
+    bool contains(const Variable& V) const
+    {
+        const auto [Index, Bit] = locate(V);
+        const auto* It = findBlock(Index);
+        return It != Blocks.end() && It->Index == Index && (It->Bits & Bit) != 0;
+    }
+
+    /// Whether all variables of \p O are in this.
+    bool includes(const VariableSet& O) const
+    {
+        const auto* It = Blocks.begin();
+        for (const auto& B : O.Blocks) {
+            while (It != Blocks.end() && It->Index < B.Index) {
+                ++It;
+            }
+            if (It == Blocks.end() || It->Index != B.Index || (B.Bits & ~It->Bits) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Whether a variable with the base of \p V may be in the set. There may be false positives, but no
+    /// false negatives, which makes it a cheap filter for Variable::isParent.
+    bool mayContainBaseOf(const Variable& V) const { return (Bases & baseBit(V)) != 0; }
+
+    void insert(const Variable& V)
+    {
+        const auto [Index, Bit] = locate(V);
+        Bases |= baseBit(V);
+        auto* It = findBlock(Index);
+        if (It != Blocks.end() && It->Index == Index) {
+            It->Bits |= Bit;
+        } else {
+            Blocks.insert(It, Block { Index, Bit });
+        }
+    }
+
+    /// \returns whether \p V was in the set
+    bool erase(const Variable& V)
+    {
+        const auto [Index, Bit] = locate(V);
+        auto* It = findBlock(Index);
+        if (It == Blocks.end() || It->Index != Index || (It->Bits & Bit) == 0) {
+            return false;
+        }
+        It->Bits &= ~Bit;
+        if (It->Bits == 0) {
+            Blocks.erase(It);
+        }
+        if (Blocks.empty()) {
+            Bases = 0;
+        }
+        return true;
+    }
+
+    template <class Fn> void eraseIf(const Fn& F)
+    {
+        for (auto& B : Blocks) {
+            for (Word Rest = B.Bits; Rest != 0; Rest &= Rest - 1) {
+                const auto Bit = static_cast<unsigned>(std::countr_zero(Rest));
+                if (F(Variable::fromId(B.Index * WordBits + Bit))) {
+                    B.Bits &= ~(Word { 1 } << Bit);
+                }
+            }
+        }
+        llvm::erase_if(Blocks, [](const Block& B) { return B.Bits == 0; });
+        if (Blocks.empty()) {
+            Bases = 0;
+        }
+    }
+
+    /// Add all variables of \p O.
+    void merge(const VariableSet& O)
+    {
+        if (O.Blocks.empty()) {
+            return;
+        }
+        Bases |= O.Bases;
+
+        // Usually the words of O are a subset of ours, then they are or-ed in place
+        auto* It = Blocks.begin();
+        for (const auto& B : O.Blocks) {
+            while (It != Blocks.end() && It->Index < B.Index) {
+                ++It;
+            }
+            if (It == Blocks.end() || It->Index != B.Index) {
+                mergeBlocks(O);
+                return;
+            }
+            It->Bits |= B.Bits;
+        }
+    }
+
+    void clear()
+    {
+        Blocks.clear();
+        Bases = 0;
+    }
+
+private:
+    static std::pair<VariableTable::Id, Word> locate(const Variable& V)
+    {
+        return { V.getId() / WordBits, Word { 1 } << (V.getId() % WordBits) };
+    }
+
+    static Word baseBit(const Variable& V)
+    {
+        return Word { 1 } << (VariableTable::get().getBaseId(V.getId()) % WordBits);
+    }
+
+    /// The first block whose index is not less than \p Index
+    Block* findBlock(VariableTable::Id Index)
+    {
+        return llvm::partition_point(Blocks, [Index](const Block& B) { return B.Index < Index; });
+    }
+
+    const Block* findBlock(VariableTable::Id Index) const
+    {
+        return llvm::partition_point(Blocks, [Index](const Block& B) { return B.Index < Index; });
+    }
+
+    void mergeBlocks(const VariableSet& O)
+    {
+        llvm::SmallVector<Block, 1> Merged;
+        Merged.reserve(Blocks.size() + O.Blocks.size());
+        const auto* I = Blocks.begin();
+        const auto* J = O.Blocks.begin();
+        while (I != Blocks.end() || J != O.Blocks.end()) {
+            if (J == O.Blocks.end() || (I != Blocks.end() && I->Index < J->Index)) {
+                Merged.push_back(*I++);
+            } else if (I == Blocks.end() || J->Index < I->Index) {
+                Merged.push_back(*J++);
+            } else {
+                Merged.push_back(Block { I->Index, I->Bits | J->Bits });
+                ++I;
+                ++J;
+            }
+        }
+        Blocks = std::move(Merged);
+    }
+
+    llvm::SmallVector<Block, 1> Blocks;
+    /// Bloom filter of the base ids of the variables, see mayContainBaseOf()
+    Word Bases = 0;
+};
+
 /// A pset (points-to set) can contain:
 /// - null
 /// - static
@@ -518,7 +815,7 @@ public:
     {
         for (const ContractVariable& CV : S.Vars) {
             assert(CV != ContractVariable::returnVal(FD));
-            Vars.emplace(CV, FD);
+            Vars.insert(Variable(CV, FD));
         }
     }
 
@@ -572,6 +869,9 @@ public:
     /// Returns true if we look for S and we have S.field in the set.
     bool containsParent(const Variable& Var) const
     {
+        if (!Vars.mayContainBaseOf(Var)) {
+            return false;
+        }
         return llvm::any_of(Vars, [Var](const Variable& Other) { return Var.isParent(Other); });
     }
 
@@ -598,6 +898,9 @@ public:
         Vars.clear();
     }
 
+    /// Makes the pset unknown, as for a pointer whose pointees are not tracked.
+    void widen() { *this = PSet(); }
+
     void addNullReason(const NullReason& Reason)
     {
         assert(ContainsNull);
@@ -609,19 +912,27 @@ public:
     bool isNullableGlobal() const { return ContainsGlobal && ContainsNull && !ContainsInvalid && Vars.empty(); }
     void addGlobal() { ContainsGlobal = true; }
 
-    const std::set<Variable>& vars() const { return Vars; }
+    const VariableSet& vars() const { return Vars; }
 
-    const std::vector<InvalidationReason>& invReasons() const { return InvReasons; }
-    const std::vector<NullReason>& nullReasons() const { return NullReasons; }
+    const ReasonList<InvalidationReason>& invReasons() const { return InvReasons; }
+    const ReasonList<NullReason>& nullReasons() const { return NullReasons; }
 
     void addReasonTarget(const Variable& V)
     {
-        for (auto& R : InvReasons) {
+        InvReasons.update([&V](InvalidationReason& R) {
+            if (R.getInvalidatedMemory() == V) {
+                return false;
+            }
             R.setInvalidatedMemory(V);
-        }
-        for (auto& R : NullReasons) {
+            return true;
+        });
+        NullReasons.update([&V](NullReason& R) {
+            if (R.getNulledMemory() == V) {
+                return false;
+            }
             R.setNulledMemory(V);
-        }
+            return true;
+        });
     }
 
     bool checkSubstitutableFor(const PSet& O, SourceRange Range, LifetimeReporterBase& Reporter,
@@ -650,7 +961,10 @@ public:
         // no x or o.
         if (O.ContainsGlobal) {
             // here: 'this' is not Invalid, if 'this' is null, O must contains null, checked before
-            if (!Reporter.getOptions().LifetimePost && !Vars.empty() && Vars.begin()->isThisPointer()) {
+            // Vars are ordered by first use, so check all of them rather than the first one
+            const bool PointsIntoThis = llvm::any_of(Vars, [](const Variable& V) { return V.isThisPointer(); })
+                && llvm::all_of(Vars, [](const Variable& V) { return V.isThisPointer() || V.isReturnVal(); });
+            if (!Reporter.getOptions().LifetimePost && PointsIntoThis) {
                 /* empty */
             } else if (!ContainsGlobal && !Vars.empty()) {
                 Reporter.warnWrongPset(Range, Source, SourceName, str(), O.str());
@@ -703,6 +1017,14 @@ public:
 
     void print(raw_ostream& Out) const { Out << str() << "\n"; }
 
+    /// Whether merging \p O into this would not change it.
+    bool includes(const PSet& O) const
+    {
+        return (ContainsInvalid || !O.ContainsInvalid) && (ContainsNull || !O.ContainsNull)
+            && (ContainsGlobal || !O.ContainsGlobal)
+            && Vars.includes(O.Vars);
+    }
+
     /// Merge contents of other pset into this.
     void merge(const PSet& O)
     {
@@ -717,7 +1039,7 @@ public:
         }
         ContainsGlobal |= O.ContainsGlobal;
 
-        Vars.insert(O.Vars.begin(), O.Vars.end());
+        Vars.merge(O.Vars);
     }
 
     // This method is used to actualize the PSet of a contract with the arguments
@@ -733,7 +1055,7 @@ public:
         // Replace valid deref locations.
         if (Vars.erase(ToReplace)) {
             if (Checking) {
-                Vars.insert(To.Vars.begin(), To.Vars.end());
+                Vars.merge(To.Vars);
             } else {
                 merge(To); // TODO: verify if assigned here note is generated later on
                            // during output matching.
@@ -760,7 +1082,9 @@ public:
 
     void addFieldRefIfTypeMatch(const FieldDecl* FD)
     {
-        std::set<Variable> NewVars;
+        // Vars cannot be changed while iterating it, so collect the changes first
+        SmallVector<Variable, 2> Removed;
+        SmallVector<Variable, 2> Added;
         for (auto Var : Vars) {
             const bool TypeMatches = std::invoke([&Var, FD] {
                 if (const auto Ty = Var.getType(); !Ty.isNull()) {
@@ -776,39 +1100,42 @@ public:
             });
 
             if (TypeMatches) {
+                Removed.push_back(Var);
                 Var.addFieldRef(FD);
+                Added.push_back(Var);
             } else if (FD->getType()->isPointerType()) {
                 // pointer escape
                 ContainsGlobal = true;
-                continue;
+                Removed.push_back(Var);
             }
-
-            NewVars.insert(Var);
         }
-        Vars = NewVars;
+        replaceVars(Removed, Added);
     }
 
     void transformVars(llvm::function_ref<Variable(Variable)> Fn)
     {
-        std::set<Variable> NewVars;
-
+        SmallVector<Variable, 2> Removed;
+        SmallVector<Variable, 2> Added;
         for (const auto& Var : Vars) {
-            NewVars.insert(Fn(Var));
+            auto NewVar = Fn(Var);
+            if (NewVar != Var) {
+                Removed.push_back(Var);
+                Added.push_back(NewVar);
+            }
         }
-
-        Vars = std::move(NewVars);
+        replaceVars(Removed, Added);
     }
 
-    template <class Fn> void eraseIf(const Fn&& F) { std::erase_if(Vars, F); }
+    template <class Fn> void eraseIf(const Fn&& F) { Vars.eraseIf(F); }
 
     /// The pointer is dangling
     static PSet invalid(const InvalidationReason& Reason)
     {
-        return invalid(std::vector<InvalidationReason> { Reason });
+        return invalid(ReasonList<InvalidationReason>(Reason));
     }
 
     /// The pointer is dangling
-    static PSet invalid(const std::vector<InvalidationReason>& Reasons)
+    static PSet invalid(const ReasonList<InvalidationReason>& Reasons)
     {
         PSet Ret;
         Ret.ContainsInvalid = true;
@@ -842,22 +1169,131 @@ public:
             Ret.ContainsGlobal = true;
         } else {
             Var.deref(static_cast<int>(Deref));
-            Ret.Vars.emplace(Var);
+            Ret.Vars.insert(Var);
         }
         return Ret;
     }
 
 private:
+    /// Erase \p Removed, then insert \p Added. Both are usually empty, then Vars is left untouched.
+    void replaceVars(ArrayRef<Variable> Removed, ArrayRef<Variable> Added)
+    {
+        for (const auto& Var : Removed) {
+            Vars.erase(Var);
+        }
+        for (const auto& Var : Added) {
+            Vars.insert(Var);
+        }
+    }
+
     unsigned ContainsNull : 1;
     unsigned ContainsInvalid : 1;
     unsigned ContainsGlobal : 1;
-    std::set<Variable> Vars;
+    VariableSet Vars;
 
-    std::vector<InvalidationReason> InvReasons;
-    std::vector<NullReason> NullReasons;
+    ReasonList<InvalidationReason> InvReasons;
+    ReasonList<NullReason> NullReasons;
 }; // namespace lifetime
 
-using PSetsMap = std::map<Variable, PSet>;
+/// The memory of the analysis of the current function, or the default resource outside of runAnalysis().
+std::pmr::memory_resource* getAnalysisMemory();
+
+/// Makes the state of a function analysis allocate from a pool that is released at once when the scope
+/// ends. Nothing allocated from it, e.g. a PSetsMap, may outlive the scope.
+class AnalysisMemoryScope {
+public:
+    AnalysisMemoryScope();
+    ~AnalysisMemoryScope();
+
+    AnalysisMemoryScope(const AnalysisMemoryScope&) = delete;
+    AnalysisMemoryScope& operator=(const AnalysisMemoryScope&) = delete;
+
+private:
+    std::pmr::unsynchronized_pool_resource Pool;
+    std::pmr::memory_resource* Previous;
+};
+
+/// Maps variables to their psets at a program point.
+///
+/// The fixpoint iteration keeps an entry and exit map per CFG block, and most of them equal their neighbours.
+/// Copies therefore share the underlying map, and the first mutation of a shared map clones it (copy-on-write).
+/// Mutable accessors, including the non-const find() and begin(), detach; look up through a const reference
+/// to only read. Iterators obtained from a mutable accessor must not be written through after the map was copied.
+class PSetsMap {
+    using MapTy = std::pmr::map<Variable, PSet>;
+
+public:
+    using key_type = MapTy::key_type;
+    using mapped_type = MapTy::mapped_type;
+    using value_type = MapTy::value_type;
+    using size_type = MapTy::size_type;
+    using iterator = MapTy::iterator;
+    using const_iterator = MapTy::const_iterator;
+
+    /// Equal maps are cheap to compare when one is a copy of the other.
+    bool operator==(const PSetsMap& O) const { return sharesStorageWith(O) || get() == O.get(); }
+
+    /// Whether both maps are copies of each other, which implies they are equal.
+    bool sharesStorageWith(const PSetsMap& O) const { return Storage == O.Storage; }
+
+    const_iterator begin() const { return get().begin(); }
+    const_iterator end() const { return get().end(); }
+    iterator begin() { return getMutable().begin(); }
+    iterator end() { return getMutable().end(); }
+
+    size_type size() const { return get().size(); }
+    bool empty() const { return get().empty(); }
+
+    const_iterator find(const Variable& V) const { return get().find(V); }
+    iterator find(const Variable& V) { return getMutable().find(V); }
+    bool contains(const Variable& V) const { return get().contains(V); }
+
+    PSet& operator[](const Variable& V) { return getMutable()[V]; }
+
+    template <class... Args> std::pair<iterator, bool> emplace(Args&&... A)
+    {
+        return getMutable().emplace(std::forward<Args>(A)...);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& Entry) { return getMutable().insert(Entry); }
+
+    template <class M> std::pair<iterator, bool> insert_or_assign(const Variable& V, M&& PS) // NOLINT
+    {
+        return getMutable().insert_or_assign(V, std::forward<M>(PS));
+    }
+
+    size_type erase(const Variable& V) { return getMutable().erase(V); }
+    iterator erase(iterator It) { return getMutable().erase(It); }
+
+    template <class Fn> void eraseIf(const Fn& F) { std::erase_if(getMutable(), F); }
+
+    void clear() { Storage.reset(); }
+
+private:
+    const MapTy& get() const
+    {
+        static const MapTy Empty;
+        return Storage ? *Storage : Empty;
+    }
+
+    // New maps allocate from the memory of the current analysis, clones from the memory of their original
+    MapTy& getMutable()
+    {
+        if (!Storage) {
+            Storage = std::allocate_shared<MapTy>(std::pmr::polymorphic_allocator<MapTy>(getAnalysisMemory()));
+        } else if (Storage.use_count() > 1) {
+            const std::pmr::polymorphic_allocator<MapTy> Alloc(Storage->get_allocator());
+            Storage = std::allocate_shared<MapTy>(Alloc, *Storage);
+        }
+        return *Storage;
+    }
+
+    // Null while empty, so that default constructed maps do not allocate
+    std::shared_ptr<MapTy> Storage;
+};
+
+/// Psets of expressions, or of what they refer to, allocated from the memory of the analysis.
+using ExprPSetsMap = std::pmr::map<const Expr*, PSet>;
 
 } // namespace clang::lifetime
 
@@ -64,13 +64,16 @@ public:
 /// \param Reporter if non-null, emits diagnostics
 /// \returns false when an unsupported AST node disabled the analysis
 bool visitBlock(const FunctionDecl* FD, PSetsMap& PMap, std::optional<PSetsMap>& FalseBranchExitPMap,
-    PSetsMap& ExprMemberPMap, std::map<const Expr*, PSet>& PSetsOfExpr, std::map<const Expr*, PSet>& RefersTo,
+    PSetsMap& ExprMemberPMap, ExprPSetsMap& PSetsOfExpr, ExprPSetsMap& RefersTo,
     const CFGBlock& B, LifetimeReporterBase& Reporter, ASTContext& ASTCtxt, IsConvertibleTy IsConvertible);
 
 /// Get the initial PSets for function parameters.
 void getLifetimeContracts(PSetsMap& PMap, const FunctionDecl* FD, const ASTContext& ASTCtxt, const CFGBlock* Block,
     IsConvertibleTy IsConvertible, LifetimeReporterBase& Reporter, bool Pre = true, bool IgnoreNull = false,
     bool IgnoreFields = false);
+
+/// Drop the lifetime contracts cached for the current thread.
+void clearLifetimeContractCache();
 } // namespace lifetime
 } // namespace clang
 
@@ -74,6 +74,9 @@ inline TypeClassification classifyTypeCategory(QualType QT) { return classifyTyp
 
 bool isIteratorOrContainer(QualType QT);
 
+/// Drop the type category caches of the current thread.
+void clearTypeCategoryCaches();
+
 bool isNullableType(QualType QT);
 
 // For primitive types like pointers, references we return the pointee.
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "cppsafe/lifetime/LifetimePset.h"
+#include "cppsafe/lifetime/VariableTable.h"
+
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <vector>
+
+namespace clang {
+class CFG;
+class CFGBlock;
+class FunctionDecl;
+class VarDecl;
+
+namespace lifetime {
+
+/// Backward liveness of local variables, so that the psets of variables that are never read again can be
+/// dropped from the exit psets of a block instead of being merged and compared until they leave scope.
+///
+/// A variable is tracked if all its uses read or assign its value. The psets of variables whose address is
+/// taken, that are bound to references, captured, or used as objects, e.g. in member calls, may be read
+/// through other variables, so those are always live, as are parameters and static variables.
+class PSetLiveness {
+public:
+    PSetLiveness(const CFG& Cfg, const FunctionDecl& FD);
+
+    /// Drops the psets of tracked variables that are dead after \p B, unless a kept pset points into them.
+    void pruneExit(const CFGBlock& B, PSetsMap& PMap) const;
+
+private:
+    llvm::DenseMap<const VarDecl*, unsigned> Tracked;
+    /// Tracked variables that may be read after each block, by block id
+    std::vector<llvm::BitVector> LiveOut;
+};
+
+} // namespace lifetime
+} // namespace clang
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "cppsafe/util/pointer_variant.h"
+
+#include <clang/AST/Decl.h>
+#include <clang/AST/DeclCXX.h>
+#include <clang/AST/Expr.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+
+namespace clang::lifetime {
+
+/// The object a variable starts from, see Variable.
+using VariableBase
+    = cppsafe::PointerVariant<const VarDecl*, const BindingDecl*, const Expr*, const RecordDecl*, const FunctionDecl*>;
+static_assert(sizeof(VariableBase) == sizeof(void*), "Decl and Expr alignment should leave room for the tag");
+
+/// Field selections and dereferences applied to a base, in order. Null entries are dereferences.
+using SubVarPath = llvm::SmallVector<const FieldDecl*, 4>;
+
+/// Hash-conses variables, i.e. a base plus a path, into dense ids.
+///
+/// Equal variables get equal ids, so comparing variables compares integers. Ids are handed out in the
+/// order variables are first seen. Paths form a trie: extending a variable by a field or a dereference
+/// is a single lookup of the (parent, field) pair.
+///
+/// Variables refer to the AST of the TU being analyzed, so like the other caches the table is per
+/// thread and is dropped by clearCaches().
+class VariableTable {
+public:
+    using Id = std::uint32_t;
+
+    /// Properties that only depend on the base and the path. They are computed from the parent on first
+    /// use and kept with the variable.
+    struct Info {
+        /// The type after applying the path, null if a dereference has no known pointee
+        QualType Type;
+        /// Dereferences since the first owner on the path, -1 if there is none, see Variable::getOrder()
+        int Order;
+        /// Trailing dereferences of the path
+        unsigned DerefNum;
+        /// Whether the path selects a field of pointer type
+        bool HasPointerField;
+        /// Whether the path dereferences after selecting a pointer field, i.e. leaves the base object
+        bool DerefsPointerField;
+    };
+
+    /// The table of the current thread.
+    static VariableTable& get();
+
+    /// The variable \p Base without fields or dereferences.
+    Id getRoot(const VariableBase& Base);
+
+    /// \p Parent followed by the field \p FD, or a dereference if \p FD is null.
+    Id getChild(Id Parent, const FieldDecl* FD);
+
+    /// The variable with the path of \p V, starting from \p Base.
+    Id getWithBase(Id V, const VariableBase& Base);
+
+    /// \pre getPath(V) is not empty
+    Id getParent(Id V) const { return Entries[V].Parent; }
+
+    /// V without its path, i.e. getRoot(getBase(V)).
+    Id getBaseId(Id V) const { return Entries[V].BaseId; }
+
+    const VariableBase& getBase(Id V) const { return Entries[V].Base; }
+
+    /// The reference stays valid until the table is cleared.
+    const Info& getInfo(Id V);
+
+    /// Whether \p V is \p Ancestor, or \p Ancestor followed by more fields or dereferences.
+    bool isPrefixOf(Id Ancestor, Id V) const;
+
+    /// The reference stays valid until the table is cleared.
+    const SubVarPath& getPath(Id V) const { return Entries[V].Path; }
+
+    std::size_t size() const { return Entries.size(); }
+
+    void clear();
+
+private:
+    struct Entry {
+        VariableBase Base;
+        Id BaseId;
+        Id Parent;
+        SubVarPath Path;
+        std::optional<Info> CachedInfo;
+    };
+
+    Info computeInfo(Id V);
+
+    // A deque keeps references to paths valid while the table grows
+    std::deque<Entry> Entries;
+    llvm::DenseMap<std::pair<std::size_t, const void*>, Id> Roots;
+    llvm::DenseMap<std::pair<Id, const FieldDecl*>, Id> Children;
+};
+
+} // namespace clang::lifetime
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+namespace clang {
+class CFG;
+class CFGBlock;
+
+namespace lifetime {
+
+/// An element of a weak topological order: a block, or a loop starting at its head block.
+struct WTOElement {
+    const CFGBlock* Block;
+    /// Whether Block is the head of a loop made of Body
+    bool IsLoop = false;
+    /// The rest of the loop in order, loops nested in it are elements of their own
+    std::vector<WTOElement> Body;
+};
+
+/// Orders the blocks reachable from the entry such that, leaving out back edges to loop heads, every block
+/// comes after its predecessors (Bourdoncle, "Efficient chaotic iteration strategies with widenings"). A
+/// fixpoint is reached by visiting the blocks in order and repeating each loop, innermost first, until its
+/// head is stable. Blocks after a loop are then only visited once the loop is stable.
+std::vector<WTOElement> computeWeakTopologicalOrder(const CFG& Cfg);
+
+} // namespace lifetime
+} // namespace clang
@@ -1,48 +1,147 @@
 #pragma once
 
+#include "cppsafe/util/assert.h"
+
+#include <llvm/Support/PointerLikeTypeTraits.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <variant>
 
 namespace cppsafe {
 
+namespace detail {
+
+template <class... Types> constexpr int MinLowBitsAvailable
+    = std::min({ llvm::PointerLikeTypeTraits<Types>::NumLowBitsAvailable... });
+
+template <std::size_t I, class T> struct PointerAlternative {
+    static std::integral_constant<std::size_t, I> select(T);
+};
+
+template <class Seq, class... Types> struct PointerAlternatives;
+
+/// Overload resolution over the alternatives picks the one a value converts to, like std::variant does
+template <std::size_t... Is, class... Types>
+struct PointerAlternatives<std::index_sequence<Is...>, Types...> : PointerAlternative<Is, Types>... {
+    using PointerAlternative<Is, Types>::select...;
+};
+
+template <class U, class... Types>
+constexpr std::size_t SelectedAlternative
+    = decltype(PointerAlternatives<std::index_sequence_for<Types...>, Types...>::select(std::declval<U>()))::value;
+
+template <class T, class... Types> constexpr std::size_t indexOf()
+{
+    constexpr bool Matches[] = { std::is_same_v<T, Types>... };
+    for (std::size_t I = 0; I < sizeof...(Types); ++I) {
+        if (Matches[I]) {
+            return I;
+        }
+    }
+    return sizeof...(Types);
+}
+
+}
+
 // llvm::PointerUnion without limits
+//
+// The index of the held type is stored in the low bits of the pointer, which are free due to alignment, so
+// the variant is as large as a pointer. If there are more types than the alignment allows, it falls back to
+// a std::variant.
 template <class... Types> class PointerVariant {
+    static constexpr bool IsTagged = sizeof...(Types) <= (std::size_t { 1 } << detail::MinLowBitsAvailable<Types...>);
+    static constexpr std::uintptr_t TagMask = (std::uintptr_t { 1 } << detail::MinLowBitsAvailable<Types...>) - 1;
+
+    template <class T> static constexpr std::size_t IndexOf = detail::indexOf<T, Types...>();
+
 public:
     template <class U>
     explicit PointerVariant(U&& X)
-        requires(!std::is_same_v<U, PointerVariant>)
-        : Data(std::forward<U>(X))
+        requires(!std::is_same_v<std::remove_cvref_t<U>, PointerVariant>)
     {
+        *this = std::forward<U>(X);
     }
 
     template <class U>
     PointerVariant& operator=(const U& X)
         requires(!std::is_same_v<U, PointerVariant>)
     {
-        Data = X;
+        if constexpr (IsTagged) {
+            constexpr auto I = detail::SelectedAlternative<const U&, Types...>;
+            using T = std::tuple_element_t<I, std::tuple<Types...>>;
+
+            const auto P = reinterpret_cast<std::uintptr_t>(static_cast<T>(X));
+            CPPSAFE_ASSERT((P & TagMask) == 0);
+            Data = P | I;
+        } else {
+            Data = X;
+        }
         return *this;
     }
 
     bool operator==(const PointerVariant& Other) const { return Data == Other.Data; }
 
-    bool operator<(const PointerVariant& Other) const { return Data < Other.Data; }
+    bool operator<(const PointerVariant& Other) const
+    {
+        if constexpr (IsTagged) {
+            return std::pair(index(), Data & ~TagMask) < std::pair(Other.index(), Other.Data & ~TagMask);
+        } else {
+            return Data < Other.Data;
+        }
+    }
+
+    /// The position of the held type in Types
+    std::size_t index() const
+    {
+        if constexpr (IsTagged) {
+            return Data & TagMask;
+        } else {
+            return Data.index();
+        }
+    }
+
+    /// The held pointer, together with index() it identifies the value
+    const void* getOpaqueValue() const
+    {
+        if constexpr (IsTagged) {
+            return reinterpret_cast<const void*>(Data & ~TagMask);
+        } else {
+            return std::visit([](const auto* P) { return static_cast<const void*>(P); }, Data);
+        }
+    }
 
-    template <class T> bool is() const { return std::holds_alternative<T>(Data); }
+    template <class T> bool is() const
+    {
+        static_assert(IndexOf<T> < sizeof...(Types), "T is not a type of the variant");
+        return index() == IndexOf<T>;
+    }
 
-    template <class T> T get() const { return std::get<T>(Data); }
+    template <class T> T get() const
+    {
+        CPPSAFE_ASSERT(is<T>());
+        if constexpr (IsTagged) {
+            return reinterpret_cast<T>(Data & ~TagMask);
+        } else {
+            return std::get<T>(Data);
+        }
+    }
 
     template <class T> T dyn_cast() const // NOLINT
     {
-        const auto* P = std::get_if<T>(&Data);
-        if (!P) {
+        if (!is<T>()) {
             return nullptr;
         }
 
-        return *P;
+        return get<T>();
     }
 
 private:
-    std::variant<Types...> Data;
+    std::conditional_t<IsTagged, std::uintptr_t, std::variant<Types...>> Data;
 };
 
 }
@@ -36,4 +36,19 @@ void test_non_trival_dtor()
     d.Set(&m);
 }
 // expected-warning@-1 {{dereferencing a dangling pointer}}
-// expected-note@-2 {{pointee 'm' left the scope here}}
\ No newline at end of file
+// expected-note@-2 {{pointee 'm' left the scope here}}
+
+void test_non_trival_dtor_multiple_pointees(bool c)
+{
+    NonTrivialDtor d;
+
+    Dummy m1;
+    Dummy m2;
+    if (c) {
+        d.Set(&m1);
+    } else {
+        d.Set(&m2);
+    }
+}
+// expected-warning@-1 {{dereferencing a dangling pointer}}
+// expected-note@-2 {{pointee 'm2' left the scope here}}
@@ -0,0 +1,99 @@
+template <class T> void __lifetime_pset(T&&);
+
+void test_for_loop_exit(int n)
+{
+    int x = 0;
+    int* p = nullptr;
+    for (int i = 0; i < n; ++i) {
+        p = &x;
+    }
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null), x)}}
+}
+
+void test_nested_loops(int n)
+{
+    int x = 0;
+    int y = 0;
+    int* p = nullptr;
+    int* q = nullptr;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            q = p;
+            p = &x;
+        }
+        p = &y;
+    }
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null), y)}}
+    __lifetime_pset(q); // expected-warning {{pset(q) = ((null), x, y)}}
+}
+
+void test_while_in_for(int n)
+{
+    int x = 0;
+    int* p = nullptr;
+    for (int i = 0; i < n; ++i) {
+        while (n > i) {
+            p = &x;
+            --n;
+        }
+    }
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null), x)}}
+}
+
+void test_dead_pointer_in_loop(int n)
+{
+    int x = 0;
+    int y = 0;
+    int* p = nullptr;
+    for (int i = 0; i < n; ++i) {
+        int* t = i % 2 ? &x : &y;
+        p = t;
+    }
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null), x, y)}}
+}
+
+void test_propagation_chain(int n)
+{
+    int* p = nullptr;
+    int* q = nullptr;
+    int* r = nullptr;
+    int* s = nullptr;
+    int* t = nullptr;
+    {
+        int x = 0;
+        // Each round the loop head gains x in one more pset, so the loop runs until all of them have it
+        for (int i = 0; i < n; ++i) {
+            p = q;
+            q = r;
+            r = s;
+            s = t;
+            t = &x;
+        }
+        __lifetime_pset(p); // expected-warning {{pset(p) = ((null), x)}}
+        __lifetime_pset(q); // expected-warning {{pset(q) = ((null), x)}}
+        __lifetime_pset(r); // expected-warning {{pset(r) = ((null), x)}}
+    }
+
+    __lifetime_pset(q); // expected-warning {{pset(q) = ((invalid))}}
+    __lifetime_pset(r); // expected-warning {{pset(r) = ((invalid))}}
+    int a = *q; // expected-warning {{dereferencing a dangling pointer}}
+    // expected-note@* {{pointee 'x' left the scope here}}
+    int b = *r; // expected-warning {{dereferencing a dangling pointer}}
+    // expected-note@* {{pointee 'x' left the scope here}}
+}
+
+void test_dead_pointer_into_ended_scope(bool c)
+{
+    int* q = nullptr;
+    {
+        int x = 0;
+        int* p = &x;
+        if (c) {
+            q = p;
+        }
+        // p is dead from here on and dropped from the exit psets, so x leaving its scope only invalidates q
+    }
+    __lifetime_pset(q); // expected-warning {{pset(q) = ((invalid))}}
+    int y = *q; // expected-warning {{dereferencing a dangling pointer}}
+    // expected-note@* {{pointee 'x' left the scope here}}
+}
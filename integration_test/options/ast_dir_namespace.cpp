@@ -0,0 +1,30 @@
+// ARGS: --require-ast
+
+template <class T> void __lifetime_pset(T&&);
+
+void f()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
+
+namespace ns {
+
+void g()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
+
+namespace inner {
+
+void h()
+{
+    int x = 0;
+    int* p = &x;
+    __lifetime_pset(p); // expected-warning {{pset(p) = (x)}}
+}
+
+}
+
+}
@@ -0,0 +1,16 @@
+// ARGS: --diff=options/diff.patch
+
+#include "../feature/common.h"
+
+void changed()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
+
+// Not touched by diff.patch, an unexpected warning fails the test
+void unchanged()
+{
+    int* p = nullptr;
+    __lifetime_pset(p);
+}
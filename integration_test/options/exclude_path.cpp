@@ -0,0 +1,11 @@
+// ARGS: --exclude-path=exclude_path_skipped
+
+#include "../feature/common.h"
+
+#include "exclude_path_skipped.h"
+
+void not_excluded()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Matched by --exclude-path of exclude_path.cpp, an unexpected warning fails the test
+inline void excluded_is_not_analyzed()
+{
+    int* p = nullptr;
+    __lifetime_pset(p);
+}
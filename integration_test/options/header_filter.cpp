@@ -0,0 +1,12 @@
+// ARGS: --header-filter=header_filter_included
+
+#include "../feature/common.h"
+
+#include "header_filter_included.h"
+#include "header_filter_skipped.h"
+
+void main_file_is_always_analyzed()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
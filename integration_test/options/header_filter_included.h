@@ -0,0 +1,7 @@
+#pragma once
+
+inline void included_header_is_analyzed()
+{
+    int* p = nullptr;
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((null))}}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Not matched by --header-filter of header_filter.cpp, an unexpected warning fails the test
+inline void skipped_header_is_not_analyzed()
+{
+    int* p = nullptr;
+    __lifetime_pset(p);
+}
@@ -0,0 +1,26 @@
+// ARGS: --max-block-visits=9
+
+void test_widened(bool c, int* a)
+{
+    int x = 0;
+    // Use up the budget before the loop
+    if (c) {
+        x = 1;
+    }
+    if (c) {
+        x = 2;
+    }
+    if (c) {
+        x = 3;
+    }
+    if (c) {
+        x = 4;
+    }
+
+    int* p = nullptr;
+    while (c) { // expected-remark {{analysis of 'test_widened' exceeded its budget of 9 block visits, psets changing in this loop are widened to unknown}}
+        p = a;
+    }
+    // Would be ((null), *a) within the budget
+    __lifetime_pset(p); // expected-warning {{pset(p) = ((unknown))}}
+}
@@ -0,0 +1,11 @@
+// ARGS: --max-block-visits=1 --Wlifetime-null
+
+void test_skipped(bool c, int* a)
+{
+    int* p = a;
+    if (c) {
+        p = nullptr;
+    }
+    // Not analyzed, so the possibly null dereference is not reported. As there is no loop, nothing is widened.
+    *p = 1; // expected-remark {{analysis of 'test_skipped' exceeded its budget of 1 block visits, the rest is skipped from here}}
+}
@@ -20,4 +20,30 @@ fi
 
 src_args=$(head -n1 ${srcfile} | grep "// ARGS:" | awk -F ':' '{print $2}')
 
+# Serialized ASTs are written by cppsafe itself, so that they can be loaded by the clang it is built with, to a
+# directory of this run. --require-ast fails the run if an AST cannot be used. The ASTs are analyzed without the
+# -verify consumer of the compile command, so their output must equal the output of parsing the source, which is
+# verified
+if [[ "${src_args}" == *--require-ast* ]];
+then
+    ast_dir=$(mktemp -d)
+    trap 'rm -rf "${ast_dir}"' EXIT
+    parse_args=${src_args/--require-ast/}
+
+    $binary "${srcfile}" --ast-dir="${ast_dir}" --emit-ast $extra -- -std=c++20 -w || exit 1
+    $binary "${srcfile}" $parse_args $extra -- -Xclang -verify -std=c++20 -w || exit 1
+
+    expected=$($binary "${srcfile}" $parse_args $extra -- -std=c++20 -w 2>&1)
+    actual=$($binary "${srcfile}" --ast-dir="${ast_dir}" $src_args $extra -- -std=c++20 -w 2>&1) || {
+        echo "${actual}"
+        exit 1
+    }
+    if [[ "${expected}" != "${actual}" ]];
+    then
+        diff <(echo "${expected}") <(echo "${actual}")
+        exit 1
+    fi
+    exit 0
+fi
+
 $binary "${srcfile}" $src_args $extra -- -Xclang -verify -std=c++20 -w
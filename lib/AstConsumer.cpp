@@ -1,5 +1,6 @@
 #include "cppsafe/AstConsumer.h"
 
+#include "cppsafe/FunctionCache.h"
 #include "cppsafe/Options.h"
 #include "cppsafe/lifetime/Lifetime.h"
 #include "cppsafe/lifetime/contract/Annotation.h"
@@ -30,8 +31,11 @@
 #include <array>
 #include <cassert>
 #include <map>
+#include <optional>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace clang;
 
@@ -63,6 +67,8 @@ enum LifetimeDiag {
     warn_deref_unknown,
     warn_lifetime_type_category,
 
+    remark_budget_exceeded,
+
     note_never_initialized,
     note_pointee_left_scope,
     note_temporary_destroyed,
@@ -110,10 +116,11 @@ const std::array Notes {
 class Reporter : public LifetimeReporterBase {
     Sema& S;
     const FunctionDecl* Fn;
-    cppsafe::CppsafeOptions Options;
+    const cppsafe::CppsafeOptions& Options;
     std::set<SourceLocation> WarningLocs;
     bool IgnoreCurrentWarning = false;
     std::map<LifetimeDiag, unsigned int> WarningIds;
+    bool ExceededBudget = false;
 
     bool enableIfNew(SourceRange Range)
     {
@@ -221,6 +228,10 @@ public:
         WarningIds[LifetimeDiag::warn_lifetime_type_category] = E.getCustomDiagID(DiagnosticsEngine::Warning,
             "lifetime type category is %select{Owner|Pointer|Aggregate|Value}0 %select{|with pointee %2}1");
 
+        WarningIds[LifetimeDiag::remark_budget_exceeded] = E.getCustomDiagID(DiagnosticsEngine::Remark,
+            "analysis of '%0' exceeded its budget of %1, %select{psets changing in this loop are widened to "
+            "unknown|the rest is skipped from here}2");
+
         WarningIds[LifetimeDiag::note_never_initialized]
             = E.getCustomDiagID(DiagnosticsEngine::Note, "it was never initialized here");
         WarningIds[LifetimeDiag::note_pointee_left_scope]
@@ -422,6 +433,15 @@ public:
         S.Diag(Range.getBegin(), WarningIds[LifetimeDiag::warn_lifetime_type_category])
             << (int)Category << !Pointee.empty() << Pointee;
     }
+
+    /// Whether the analysis of the function exceeded a budget, see remarkBudgetExceeded()
+    bool hasExceededBudget() const { return ExceededBudget; }
+
+    void remarkBudgetExceeded(SourceLocation Loc, StringRef Function, StringRef Budget, bool Skipped) final
+    {
+        ExceededBudget = true;
+        S.Diag(Loc, WarningIds[LifetimeDiag::remark_budget_exceeded]) << Function << Budget << Skipped;
+    }
 };
 
 } // namespace clang::lifetime
@@ -431,6 +451,7 @@ namespace cppsafe {
 void AstConsumer::InitializeSema(clang::Sema& S)
 {
     Sema = &S;
+    lifetime::clearCaches();
     lifetime::setSema(&S);
 }
 
@@ -468,6 +489,14 @@ bool AstConsumer::HandleTopLevelDecl(clang::DeclGroupRef D)
                 return true;
             }
 
+            if (!Consumer->isOwnedLocation(D->getBeginLoc()) || !Consumer->isChanged(D)) {
+                return true;
+            }
+
+            if (Consumer->Registry && !Consumer->Registry->claim(D, S->getSourceManager())) {
+                return true;
+            }
+
             Consumer->run(D);
             return true;
         }
@@ -479,11 +508,86 @@ bool AstConsumer::HandleTopLevelDecl(clang::DeclGroupRef D)
 
     Visitor V { this, Sema };
     for (auto* Decl : D) {
-        V.TraverseDecl(Decl);
+        // Skip whole namespaces and classes of non-owned or unchanged files instead of filtering each of their
+        // functions
+        if (isOwnedLocation(Decl->getBeginLoc())
+            && (!Options.Changed || getChangedLines(Decl->getBeginLoc()) != nullptr)) {
+            V.TraverseDecl(Decl);
+        }
     }
     return true;
 }
 
+bool AstConsumer::isOwnedLocation(clang::SourceLocation Loc)
+{
+    if (Options.HeaderFilter.empty() && Options.ExcludePath.empty()) {
+        return true;
+    }
+
+    const auto& SM = Sema->getSourceManager();
+    const auto File = SM.getFileID(SM.getExpansionLoc(Loc));
+    if (File.isInvalid()) {
+        return true;
+    }
+
+    auto [It, Inserted] = OwnedFiles.try_emplace(File, true);
+    if (!Inserted) {
+        return It->second;
+    }
+
+    const auto Entry = SM.getFileEntryRefForID(File);
+    if (!Entry) {
+        return true;
+    }
+
+    const auto Name = Entry->getName();
+    if (!Options.ExcludePath.empty() && ExcludePath.match(Name)) {
+        It->second = false;
+    } else if (!Options.HeaderFilter.empty() && File != SM.getMainFileID()) {
+        It->second = HeaderFilter.match(Name);
+    }
+
+    return It->second;
+}
+
+const std::vector<ChangedLines::Range>* AstConsumer::getChangedLines(clang::SourceLocation Loc)
+{
+    const auto& SM = Sema->getSourceManager();
+    const auto File = SM.getFileID(SM.getExpansionLoc(Loc));
+    if (File.isInvalid()) {
+        return nullptr;
+    }
+
+    auto [It, Inserted] = ChangedFiles.try_emplace(File, nullptr);
+    if (!Inserted) {
+        return It->second;
+    }
+
+    if (const auto Entry = SM.getFileEntryRefForID(File)) {
+        // Paths of the diff are relative to the repository, match them against the absolute path
+        const auto RealPath = Entry->getFileEntry().tryGetRealPathName();
+        It->second = Options.Changed->find(RealPath.empty() ? Entry->getName() : RealPath);
+    }
+    return It->second;
+}
+
+bool AstConsumer::isChanged(const clang::FunctionDecl* Fn)
+{
+    if (!Options.Changed) {
+        return true;
+    }
+
+    const auto* Lines = getChangedLines(Fn->getBeginLoc());
+    if (Lines == nullptr) {
+        return false;
+    }
+
+    const auto& SM = Sema->getSourceManager();
+    const auto Range = SM.getExpansionRange(Fn->getSourceRange());
+    return ChangedLines::overlaps(
+        *Lines, SM.getExpansionLineNumber(Range.getBegin()), SM.getExpansionLineNumber(Range.getEnd()));
+}
+
 void AstConsumer::run(const clang::FunctionDecl* Fn)
 {
     auto IsConvertible = [this, Fn](QualType From, QualType To) {
@@ -496,7 +600,38 @@ void AstConsumer::run(const clang::FunctionDecl* Fn)
     };
 
     lifetime::Reporter Reporter(*Sema, Fn, Options);
-    lifetime::runAnalysis(Fn, Sema->getASTContext(), Reporter, IsConvertible);
+    if (FnCache == nullptr || !lifetime::shouldAnalyze(Fn)) {
+        lifetime::runAnalysis(Fn, Sema->getASTContext(), Reporter, IsConvertible);
+        return;
+    }
+
+    // Contracts of callees are computed here, their diagnostics are emitted on hits and misses alike
+    const auto Fingerprint = fingerprintFunction(Fn, Sema->getASTContext(), IsConvertible, Reporter);
+    if (!Fingerprint) {
+        lifetime::runAnalysis(Fn, Sema->getASTContext(), Reporter, IsConvertible);
+        if (Reporter.hasExceededBudget()) {
+            FnCache->noteBudgetExceeded();
+        }
+        return;
+    }
+
+    auto& Diags = Sema->getDiagnostics();
+    if (const auto* Cached = FnCache->lookup(*Fingerprint)) {
+        replayFunctionDiags(Diags, Fn, *Cached);
+        return;
+    }
+
+    std::optional<std::vector<FunctionDiag>> Records;
+    {
+        FunctionDiagRecorder Recorder(Diags, Fn);
+        lifetime::runAnalysis(Fn, Sema->getASTContext(), Reporter, IsConvertible);
+        Records = Recorder.takeDiags();
+    }
+    if (Reporter.hasExceededBudget()) {
+        FnCache->noteBudgetExceeded();
+    } else if (Records) {
+        FnCache->insert(*Fingerprint, std::move(*Records));
+    }
 }
 
 } // namespace cppsafe
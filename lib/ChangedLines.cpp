@@ -0,0 +1,150 @@
+#include "cppsafe/ChangedLines.h"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Twine.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+namespace cppsafe {
+
+namespace {
+
+llvm::Error makeDiffError(unsigned LineNo, const llvm::Twine& Message)
+{
+    return llvm::createStringError(
+        llvm::inconvertibleErrorCode(), "diff line " + llvm::Twine(LineNo) + ": " + Message);
+}
+
+/// Parse `start[,count]` of a hunk header, the count defaults to 1.
+bool parseHunkRange(llvm::StringRef S, unsigned& Start, unsigned& Count)
+{
+    const auto [StartStr, CountStr] = S.split(',');
+    Count = 1;
+    return !StartStr.getAsInteger(10, Start) && (CountStr.empty() || !CountStr.getAsInteger(10, Count));
+}
+
+void addRange(std::vector<ChangedLines::Range>* Ranges, unsigned First, unsigned Last)
+{
+    if (Ranges != nullptr) {
+        Ranges->push_back({ First, Last });
+    }
+}
+
+void normalize(std::vector<ChangedLines::Range>& Ranges)
+{
+    llvm::sort(Ranges, [](const auto& L, const auto& R) { return L.First < R.First; });
+
+    std::vector<ChangedLines::Range> Merged;
+    for (const auto& R : Ranges) {
+        if (!Merged.empty() && R.First <= Merged.back().Last + 1) {
+            Merged.back().Last = std::max(Merged.back().Last, R.Last);
+        } else {
+            Merged.push_back(R);
+        }
+    }
+    Ranges = std::move(Merged);
+}
+
+}
+
+llvm::Expected<ChangedLines> ChangedLines::parseUnifiedDiff(llvm::StringRef Diff)
+{
+    ChangedLines Result;
+    std::vector<Range>* Current = nullptr;
+
+    // Lines left in the current hunk, and the line number of the next line of the new file
+    unsigned OldLeft = 0;
+    unsigned NewLeft = 0;
+    unsigned NewLine = 0;
+
+    llvm::SmallVector<llvm::StringRef> Lines;
+    Diff.split(Lines, '\n');
+    for (std::size_t I = 0; I < Lines.size(); ++I) {
+        const auto LineNo = static_cast<unsigned>(I + 1);
+        auto Line = Lines[I].rtrim('\r');
+
+        if (OldLeft > 0 || NewLeft > 0) {
+            // "\ No newline at end of file"
+            if (Line.startswith("\\")) {
+                continue;
+            }
+
+            const char Kind = Line.empty() ? ' ' : Line.front();
+            if (Kind == '+' && NewLeft > 0) {
+                addRange(Current, NewLine, NewLine);
+                ++NewLine;
+                --NewLeft;
+            } else if (Kind == '-' && OldLeft > 0) {
+                addRange(Current, NewLine - 1, NewLine);
+                --OldLeft;
+            } else if (Kind == ' ' && OldLeft > 0 && NewLeft > 0) {
+                ++NewLine;
+                --OldLeft;
+                --NewLeft;
+            } else {
+                return makeDiffError(LineNo, "hunk does not match its header");
+            }
+            continue;
+        }
+
+        if (Line.consume_front("+++ ")) {
+            auto Name = Line.split('\t').first.rtrim();
+            if (Name == "/dev/null") {
+                Current = nullptr;
+                continue;
+            }
+            Name.consume_front("b/");
+            Current = &Result.Files[Name.str()];
+            continue;
+        }
+
+        if (Line.consume_front("@@ ")) {
+            // @@ -start[,count] +start[,count] @@
+            auto [Old, Rest] = Line.split(' ');
+            const auto New = Rest.split(' ').first;
+            unsigned OldStart = 0;
+            unsigned NewStart = 0;
+            if (!Old.consume_front("-") || !parseHunkRange(Old, OldStart, OldLeft) || !New.startswith("+")
+                || !parseHunkRange(New.drop_front(), NewStart, NewLeft)) {
+                return makeDiffError(LineNo, "malformed hunk header");
+            }
+
+            // An empty range starts at the line before it
+            NewLine = NewLeft == 0 ? NewStart + 1 : NewStart;
+        }
+    }
+
+    for (auto& Entry : Result.Files) {
+        normalize(Entry.second);
+    }
+    return Result;
+}
+
+bool ChangedLines::matches(llvm::StringRef Path, llvm::StringRef DiffName)
+{
+    if (!Path.endswith(DiffName)) {
+        return false;
+    }
+    return Path.size() == DiffName.size() || Path[Path.size() - DiffName.size() - 1] == '/';
+}
+
+const std::vector<ChangedLines::Range>* ChangedLines::find(llvm::StringRef Path) const
+{
+    for (const auto& [Name, Ranges] : Files) {
+        if (matches(Path, Name)) {
+            return &Ranges;
+        }
+    }
+    return nullptr;
+}
+
+bool ChangedLines::overlaps(const std::vector<Range>& Ranges, unsigned First, unsigned Last)
+{
+    const auto It = llvm::partition_point(Ranges, [First](const Range& R) { return R.Last < First; });
+    return It != Ranges.end() && It->First <= Last;
+}
+
+}
@@ -0,0 +1,448 @@
+#include "cppsafe/FunctionCache.h"
+
+#include "cppsafe/lifetime/LifetimePset.h"
+#include "cppsafe/lifetime/LifetimePsetBuilder.h"
+#include "cppsafe/lifetime/LifetimeTypeCategory.h"
+
+#include <clang/AST/Attr.h>
+#include <clang/AST/ExprCXX.h>
+#include <clang/AST/ODRHash.h>
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/BLAKE3.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <utility>
+
+using namespace clang;
+
+namespace cppsafe {
+
+namespace {
+
+void hashInt(llvm::BLAKE3& Hasher, std::uint64_t V)
+{
+    std::array<std::uint8_t, sizeof(V)> Bytes {};
+    llvm::support::endian::write64le(Bytes.data(), V);
+    Hasher.update(Bytes);
+}
+
+void hashString(llvm::BLAKE3& Hasher, llvm::StringRef S)
+{
+    hashInt(Hasher, S.size());
+    Hasher.update(S);
+}
+
+/// Callees, types and records the analysis of a function looks at, in a deterministic order.
+///
+/// ODRHash refers to members and types by name only, so the types of all expressions and the definitions of the
+/// records they use are collected, e.g. to see that a header changed the type of a field.
+class InputCollector : public RecursiveASTVisitor<InputCollector> {
+public:
+    bool VisitExpr(Expr* E)
+    {
+        addType(E->getType());
+        return true;
+    }
+
+    bool VisitMemberExpr(MemberExpr* E)
+    {
+        if (const auto* FD = dyn_cast<FieldDecl>(E->getMemberDecl())) {
+            addRecord(FD->getParent());
+        }
+        return true;
+    }
+
+    bool VisitCallExpr(CallExpr* E)
+    {
+        addCallee(E->getDirectCallee());
+        return true;
+    }
+
+    bool VisitCXXConstructExpr(CXXConstructExpr* E)
+    {
+        addCallee(E->getConstructor());
+        return true;
+    }
+
+    bool VisitVarDecl(VarDecl* D)
+    {
+        addType(D->getType());
+        return true;
+    }
+
+    void addCallee(const FunctionDecl* FD)
+    {
+        if (FD != nullptr && SeenCallees.insert(FD->getCanonicalDecl()).second) {
+            Callees.push_back(FD);
+        }
+    }
+
+    void addType(QualType T)
+    {
+        if (T.isNull() || T->isDependentType() || T->isIncompleteType()) {
+            return;
+        }
+        if (SeenTypes.insert(T.getCanonicalType().getAsOpaquePtr()).second) {
+            Types.push_back(T);
+            addRecord(T.getNonReferenceType()->getPointeeOrArrayElementType()->getAsRecordDecl());
+        }
+    }
+
+    void addRecord(const RecordDecl* RD)
+    {
+        const auto* Def = RD != nullptr ? RD->getDefinition() : nullptr;
+        if (Def != nullptr && SeenRecords.insert(Def).second) {
+            Records.push_back(Def);
+        }
+    }
+
+    // NOLINTBEGIN(cppcoreguidelines-non-private-member-variables-in-classes)
+    std::vector<const FunctionDecl*> Callees;
+    std::vector<QualType> Types;
+    std::vector<const RecordDecl*> Records;
+    // NOLINTEND(cppcoreguidelines-non-private-member-variables-in-classes)
+
+private:
+    llvm::SmallPtrSet<const FunctionDecl*, 16> SeenCallees;
+    llvm::SmallPtrSet<const void*, 32> SeenTypes;
+    llvm::SmallPtrSet<const RecordDecl*, 16> SeenRecords;
+};
+
+/// The layout of a record as the analysis sees it, ODRHash skips template specializations.
+void hashRecord(llvm::BLAKE3& Hasher, const RecordDecl* RD)
+{
+    hashString(Hasher, RD->getQualifiedNameAsString());
+    if (const auto* CRD = dyn_cast<CXXRecordDecl>(RD)) {
+        for (const auto& Base : CRD->bases()) {
+            hashString(Hasher, Base.getType().getCanonicalType().getAsString());
+        }
+    }
+    for (const auto* Field : RD->fields()) {
+        hashString(Hasher, Field->getName());
+        hashString(Hasher, Field->getType().getCanonicalType().getAsString());
+    }
+}
+
+/// PSetsMap is ordered by the first use of each variable, sort by names to get a result that does not depend on it.
+std::vector<std::string> describeContracts(const FunctionDecl* FD, ASTContext& Ctx,
+    lifetime::IsConvertibleTy IsConvertible, lifetime::LifetimeReporterBase& Reporter, bool Pre)
+{
+    lifetime::PSetsMap PMap;
+    lifetime::getLifetimeContracts(PMap, FD, Ctx, nullptr, IsConvertible, Reporter, Pre);
+
+    std::vector<std::string> Entries;
+    Entries.reserve(PMap.size());
+    for (const auto& [V, PS] : PMap) {
+        Entries.push_back(V.getName() + " -> " + PS.str());
+    }
+    llvm::sort(Entries);
+    return Entries;
+}
+
+std::optional<std::pair<FileID, std::pair<unsigned, unsigned>>> getFileRange(
+    const FunctionDecl* Fn, const SourceManager& SM, const LangOptions& LangOpts)
+{
+    const auto Range = Fn->getSourceRange();
+    if (Range.isInvalid() || Range.getBegin().isMacroID() || Range.getEnd().isMacroID()) {
+        return std::nullopt;
+    }
+
+    const auto [BeginFile, Begin] = SM.getDecomposedLoc(Range.getBegin());
+    const auto [EndFile, End] = SM.getDecomposedLoc(Range.getEnd());
+    if (BeginFile != EndFile) {
+        return std::nullopt;
+    }
+
+    return std::pair { BeginFile, std::pair { Begin, End + Lexer::MeasureTokenLength(Range.getEnd(), SM, LangOpts) } };
+}
+
+}
+
+llvm::json::Value toJSON(const FunctionDiag::Range& R)
+{
+    return llvm::json::Object {
+        { "begin", R.Begin },
+        { "end", R.End },
+        { "token", R.IsTokenRange },
+    };
+}
+
+llvm::json::Value toJSON(const FunctionDiag& D)
+{
+    return llvm::json::Object {
+        { "level", static_cast<int>(D.Level) },
+        { "offset", D.Offset },
+        { "ranges", D.Ranges },
+        { "message", D.Message },
+    };
+}
+
+bool fromJSON(const llvm::json::Value& V, FunctionDiag::Range& R, llvm::json::Path P)
+{
+    llvm::json::ObjectMapper O(V, P);
+    return O && O.map("begin", R.Begin) && O.map("end", R.End) && O.map("token", R.IsTokenRange);
+}
+
+bool fromJSON(const llvm::json::Value& V, FunctionDiag& D, llvm::json::Path P)
+{
+    int Level = 0;
+    llvm::json::ObjectMapper O(V, P);
+    if (!O || !O.map("level", Level) || !O.map("offset", D.Offset) || !O.map("ranges", D.Ranges)
+        || !O.map("message", D.Message)) {
+        return false;
+    }
+
+    D.Level = static_cast<DiagnosticsEngine::Level>(Level);
+    return true;
+}
+
+FunctionCache::FunctionCache(std::string Path)
+    : Path(std::move(Path))
+{
+    if (this->Path.empty()) {
+        return;
+    }
+
+    auto Buffer = llvm::MemoryBuffer::getFile(this->Path);
+    if (!Buffer) {
+        return;
+    }
+
+    auto Loaded = llvm::json::parse<std::map<std::string, std::vector<FunctionDiag>>>(Buffer.get()->getBuffer());
+    if (!Loaded) {
+        // A broken cache only costs a full analysis
+        llvm::consumeError(Loaded.takeError());
+        return;
+    }
+    for (auto& [Fingerprint, Diags] : *Loaded) {
+        Entries[Fingerprint].Diags = std::move(Diags);
+    }
+}
+
+const std::vector<FunctionDiag>* FunctionCache::lookup(llvm::StringRef Fingerprint)
+{
+    auto It = Entries.find(Fingerprint);
+    if (It == Entries.end()) {
+        ++Misses;
+        return nullptr;
+    }
+
+    ++Hits;
+    It->second.Used = true;
+    return &It->second.Diags;
+}
+
+void FunctionCache::insert(llvm::StringRef Fingerprint, std::vector<FunctionDiag> Diags)
+{
+    auto& E = Entries[Fingerprint];
+    E.Diags = std::move(Diags);
+    E.Used = true;
+}
+
+void FunctionCache::save()
+{
+    for (auto It = Entries.begin(); It != Entries.end();) {
+        auto Cur = It++;
+        if (Cur->second.Used) {
+            Cur->second.Used = false;
+        } else {
+            Entries.erase(Cur);
+        }
+    }
+    if (Path.empty()) {
+        return;
+    }
+
+    llvm::json::Object Root;
+    for (const auto& E : Entries) {
+        Root[E.first()] = E.second.Diags;
+    }
+
+    // writeToOutput writes to a temporary file first, concurrent runs never see a partial cache
+    auto Err = llvm::writeToOutput(Path, [&Root](llvm::raw_ostream& OS) {
+        OS << llvm::json::Value(std::move(Root));
+        return llvm::Error::success();
+    });
+    if (Err) {
+        llvm::WithColor::warning() << "cannot write function cache " << Path << ": "
+                                   << llvm::toString(std::move(Err)) << "\n";
+    }
+}
+
+std::optional<std::string> fingerprintFunction(const FunctionDecl* Fn, ASTContext& Ctx,
+    lifetime::IsConvertibleTy IsConvertible, lifetime::LifetimeReporterBase& Reporter)
+{
+    const auto& SM = Ctx.getSourceManager();
+    if (!Fn->doesThisDeclarationHaveABody() || !getFileRange(Fn, SM, Ctx.getLangOpts())) {
+        return std::nullopt;
+    }
+
+    llvm::BLAKE3 Hasher;
+
+    // The text decides the offsets of the diagnostics, the AST covers what macros and includes did to it
+    bool Invalid = false;
+    const auto Text = Lexer::getSourceText(
+        CharSourceRange::getTokenRange(Fn->getSourceRange()), SM, Ctx.getLangOpts(), &Invalid);
+    if (Invalid) {
+        return std::nullopt;
+    }
+    hashString(Hasher, Text);
+
+    ODRHash ODR;
+    ODR.AddStmt(Fn->getBody());
+    ODR.AddQualType(Fn->getType());
+    hashInt(Hasher, ODR.CalculateHash());
+
+    for (const auto* A : Fn->attrs()) {
+        std::string Printed;
+        llvm::raw_string_ostream OS(Printed);
+        A->printPretty(OS, Ctx.getPrintingPolicy());
+        hashString(Hasher, OS.str());
+    }
+
+    InputCollector Collector;
+    Collector.addCallee(Fn);
+    Collector.TraverseDecl(const_cast<FunctionDecl*>(Fn)); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+    Collector.addType(Fn->getReturnType());
+
+    for (const auto* Callee : Collector.Callees) {
+        hashString(Hasher, Callee->getQualifiedNameAsString());
+        for (const bool Pre : { true, false }) {
+            for (const auto& Contract : describeContracts(Callee, Ctx, IsConvertible, Reporter, Pre)) {
+                hashString(Hasher, Contract);
+            }
+        }
+
+        Collector.addType(Callee->getReturnType());
+        for (const auto* Param : Callee->parameters()) {
+            Collector.addType(Param->getType());
+        }
+    }
+
+    for (const auto& T : Collector.Types) {
+        hashString(Hasher, T.getAsString());
+        hashString(Hasher, lifetime::classifyTypeCategory(T).str());
+    }
+
+    for (const auto* RD : Collector.Records) {
+        hashRecord(Hasher, RD);
+    }
+
+    return llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+}
+
+FunctionDiagRecorder::FunctionDiagRecorder(DiagnosticsEngine& Diags, const FunctionDecl* Fn)
+    : Diags(Diags)
+    , Target(Diags.getClient())
+    , OwnedTarget(Diags.takeClient())
+{
+    Diags.setClient(this, /*ShouldOwnClient=*/false);
+
+    const auto& Ctx = Fn->getASTContext();
+    if (const auto Range = getFileRange(Fn, Ctx.getSourceManager(), Ctx.getLangOpts())) {
+        File = Range->first;
+        Begin = Range->second.first;
+        End = Range->second.second;
+    } else {
+        Replayable = false;
+    }
+}
+
+FunctionDiagRecorder::~FunctionDiagRecorder()
+{
+    if (OwnedTarget) {
+        Diags.setClient(OwnedTarget.release(), /*ShouldOwnClient=*/true);
+    } else {
+        Diags.setClient(Target, /*ShouldOwnClient=*/false);
+    }
+}
+
+std::optional<unsigned> FunctionDiagRecorder::getOffset(SourceLocation Loc) const
+{
+    if (Loc.isInvalid() || Loc.isMacroID()) {
+        return std::nullopt;
+    }
+
+    const auto [LocFile, Offset] = Diags.getSourceManager().getDecomposedLoc(Loc);
+    if (LocFile != File || Offset < Begin || Offset > End) {
+        return std::nullopt;
+    }
+
+    return Offset - Begin;
+}
+
+void FunctionDiagRecorder::HandleDiagnostic(DiagnosticsEngine::Level Level, const Diagnostic& Info)
+{
+    DiagnosticConsumer::HandleDiagnostic(Level, Info);
+    Target->HandleDiagnostic(Level, Info);
+
+    if (!Replayable) {
+        return;
+    }
+
+    const auto Offset = getOffset(Info.getLocation());
+    if (!Offset || Level == DiagnosticsEngine::Fatal || Info.getNumFixItHints() != 0) {
+        Replayable = false;
+        return;
+    }
+
+    FunctionDiag D;
+    D.Level = Level;
+    D.Offset = *Offset;
+    for (const auto& R : Info.getRanges()) {
+        const auto RangeBegin = getOffset(R.getBegin());
+        const auto RangeEnd = getOffset(R.getEnd());
+        if (!RangeBegin || !RangeEnd) {
+            Replayable = false;
+            return;
+        }
+        D.Ranges.push_back({ .Begin = *RangeBegin, .End = *RangeEnd, .IsTokenRange = R.isTokenRange() });
+    }
+
+    llvm::SmallString<128> Message;
+    Info.FormatDiagnostic(Message);
+    D.Message = std::string(Message);
+
+    Records.push_back(std::move(D));
+}
+
+std::optional<std::vector<FunctionDiag>> FunctionDiagRecorder::takeDiags()
+{
+    if (!Replayable) {
+        return std::nullopt;
+    }
+
+    return std::move(Records);
+}
+
+void replayFunctionDiags(DiagnosticsEngine& Diags, const FunctionDecl* Fn, const std::vector<FunctionDiag>& Records)
+{
+    // fingerprintFunction only accepts functions starting at a file location
+    const auto Start = Fn->getSourceRange().getBegin();
+    for (const auto& D : Records) {
+        auto Builder = Diags.Report(Start.getLocWithOffset(static_cast<int>(D.Offset)),
+            Diags.getCustomDiagID(D.Level, "%0"));
+        Builder << D.Message;
+        for (const auto& R : D.Ranges) {
+            const SourceRange Range(Start.getLocWithOffset(static_cast<int>(R.Begin)),
+                Start.getLocWithOffset(static_cast<int>(R.End)));
+            Builder << (R.IsTokenRange ? CharSourceRange::getTokenRange(Range) : CharSourceRange::getCharRange(Range));
+        }
+    }
+}
+
+}
@@ -0,0 +1,59 @@
+#include "cppsafe/FunctionRegistry.h"
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclBase.h>
+#include <clang/AST/PrettyPrinter.h>
+#include <clang/Basic/FileEntry.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <utility>
+
+namespace cppsafe {
+
+std::optional<std::string> FunctionRegistry::getIdentity(
+    const clang::FunctionDecl* Fn, const clang::SourceManager& SM)
+{
+    const auto Loc = SM.getExpansionLoc(Fn->getBeginLoc());
+    const auto [File, Offset] = SM.getDecomposedLoc(Loc);
+    if (File.isInvalid() || File == SM.getMainFileID()) {
+        return std::nullopt;
+    }
+
+    const auto Entry = SM.getFileEntryRefForID(File);
+    if (!Entry) {
+        return std::nullopt;
+    }
+
+    std::string Identity;
+    llvm::raw_string_ostream OS(Identity);
+
+    // Headers may be included through different paths by different TUs
+    const auto RealPath = Entry->getFileEntry().tryGetRealPathName();
+    OS << (RealPath.empty() ? Entry->getName() : RealPath) << ':' << Offset;
+
+    // Instantiations share the location of their pattern, and so do lambdas in different
+    // instantiations of the same function
+    const auto& Policy = Fn->getASTContext().getPrintingPolicy();
+    for (const clang::DeclContext* DC = Fn; DC != nullptr; DC = DC->getParent()) {
+        if (const auto* F = llvm::dyn_cast<clang::FunctionDecl>(DC)) {
+            OS << '\0';
+            F->getNameForDiagnostic(OS, Policy, /*Qualified=*/true);
+            OS << '\0' << F->getType().getAsString(Policy);
+        }
+    }
+
+    return std::move(OS.str());
+}
+
+bool FunctionRegistry::claim(const clang::FunctionDecl* Fn, const clang::SourceManager& SM)
+{
+    const auto Identity = getIdentity(Fn, SM);
+    if (!Identity) {
+        return true;
+    }
+
+    const std::lock_guard Lock(Mutex);
+    return Claimed.insert(*Identity).second;
+}
+
+}
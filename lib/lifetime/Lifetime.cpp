@@ -11,6 +11,9 @@
 #include "cppsafe/lifetime/LifetimePset.h"
 #include "cppsafe/lifetime/LifetimePsetBuilder.h"
 #include "cppsafe/lifetime/LifetimeTypeCategory.h"
+#include "cppsafe/lifetime/PSetLiveness.h"
+#include "cppsafe/lifetime/VariableTable.h"
+#include "cppsafe/lifetime/WeakTopologicalOrder.h"
 
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Attr.h>
@@ -20,20 +23,24 @@
 #include <clang/AST/Stmt.h>
 #include <clang/Analysis/AnalysisDeclContext.h>
 #include <clang/Analysis/CFG.h>
-#include <clang/Analysis/FlowSensitive/DataflowWorklist.h>
 #include <clang/Basic/LLVM.h>
 #include <clang/Basic/SourceLocation.h>
 #include <clang/Basic/SourceManager.h>
 #include <gsl/pointers>
 #include <llvm/ADT/BitVector.h>
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/Statistic.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <map>
+#include <memory_resource>
 #include <optional>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -158,8 +165,20 @@ class LifetimeContext {
         /// For blocks representing a branch, we have different psets for
         /// the true and the false branch.
         std::optional<PSetsMap> FalseBranchExitPMap;
+        /// The predecessor psets last merged into EntryPMap. A predecessor whose psets were not recomputed since
+        /// need not be merged again: merging only adds to EntryPMap, and the only psets removed from it are the
+        /// widened ones, which stay unknown whatever is merged, see widenEntryPSets(). A recomputed predecessor is
+        /// merged whole, and a changed EntryPMap visits the whole block again.
+        llvm::SmallDenseMap<const CFGBlock*, PSetsMap, 2> MergedPredPMaps;
+        /// Whether the block was visited at least once
+        bool Visited = false;
+        /// Variables whose entry psets were widened, see widenEntryPSets()
+        llvm::DenseSet<VariableTable::Id> WidenedVars;
     };
 
+    /// How far the analysis exceeded its budget, see withinBudget()
+    enum class BudgetState { Within, Degraded, Exhausted };
+
     ASTContext& ASTCtxt;
     CFG* ControlFlowGraph;
     const FunctionDecl* FuncDecl;
@@ -168,11 +187,26 @@ class LifetimeContext {
     LifetimeReporterBase& Reporter;
     IsConvertibleTy IsConvertible;
 
+    std::optional<PSetLiveness> Liveness;
+
     PSetsMap ExprMemberPMap;
-    std::map<const Expr*, PSet> PSetsOfExpr;
-    std::map<const Expr*, PSet> RefersTo;
+    ExprPSetsMap PSetsOfExpr { getAnalysisMemory() };
+    ExprPSetsMap RefersTo { getAnalysisMemory() };
 
+    unsigned IterationCount = 0;
+    BudgetState Budget = BudgetState::Within;
+    /// The budget that was exceeded, e.g. "100 block visits"
+    std::string ExceededBudget;
+    /// Whether a loop was widened since the budget was exceeded, which is reported once
+    bool ReportedWidening = false;
+    std::chrono::steady_clock::time_point StartTime = std::chrono::steady_clock::now();
+
+    bool withinBudget(const CFGBlock& B);
+    void remarkBudgetExceeded(const CFGBlock& B, bool Skipped);
     void computeEntryPSets(const CFGBlock& B);
+    void widenEntryPSets(const CFGBlock& B, BlockContext& BC, const PSetsMap& OrigEntryPMap, bool Extend);
+    bool updateBlock(const CFGBlock& B, bool Widen);
+    void stabilize(const WTOElement& E);
 
     BlockContext& getBlockContext(const CFGBlock* B) { return BlockContexts[B->getBlockID()]; }
 
@@ -235,6 +269,11 @@ public:
         // dumpCFG();
         BlockContexts.resize(ControlFlowGraph->getNumBlockIDs());
 
+        // Filtering compares block exit psets after the analysis, so they keep their dead variables then
+        if (!Reporter.shouldFilterWarnings()) {
+            Liveness.emplace(*ControlFlowGraph, *FuncDecl);
+        }
+
         if (Reporter.shouldFilterWarnings()) {
             // Returns true if a block overwrites a variable that contains null or
             // invalid with something that is not null or invalid.
@@ -242,7 +281,7 @@ public:
                 if (!V) {
                     return false;
                 }
-                BlockContext& BCtx = getBlockContext(&B);
+                const BlockContext& BCtx = getBlockContext(&B);
                 auto PSetOfVarBefore = BCtx.EntryPMap.find(*V);
                 auto PSetOfVarAfter = BCtx.ExitPMap.find(*V);
                 if (PSetOfVarBefore == BCtx.EntryPMap.end()) {
@@ -266,16 +305,26 @@ public:
     void dumpCFG() const { ControlFlowGraph->dump(ASTCtxt.getLangOpts(), true); }
 };
 
-static void mergePMaps(PSetsMap& From, PSetsMap& To)
+static void mergePMaps(const PSetsMap& From, PSetsMap& To)
 {
-    for (auto& I : From) {
+    if (To.sharesStorageWith(From)) {
+        return;
+    }
+    if (To.empty()) {
+        To = From;
+        return;
+    }
+
+    // Look up through a const view, so that To keeps sharing its storage as long as nothing changes
+    const PSetsMap& ConstTo = To;
+    for (const auto& I : From) {
         const auto& Var = I.first;
-        auto& PS = I.second;
-        auto J = To.find(Var);
-        if (J == To.end()) {
+        const auto& PS = I.second;
+        auto J = ConstTo.find(Var);
+        if (J == ConstTo.end()) {
             To.insert(I);
-        } else {
-            J->second.merge(PS);
+        } else if (!J->second.includes(PS)) {
+            To[Var].merge(PS);
         }
     }
 }
@@ -325,11 +374,32 @@ void LifetimeContext::computeEntryPSets(const CFGBlock& B)
                 = (PredBlock->succ_size() == 2 && *PredBlock->succ_rbegin() == &B && PredBC.FalseBranchExitPMap)
                 ? *PredBC.FalseBranchExitPMap
                 : PredBC.ExitPMap;
+            auto& Merged = BC.MergedPredPMaps[PredBlock];
+            if (Merged.sharesStorageWith(PredPMap)) {
+                continue;
+            }
             mergePMaps(PredPMap, BC.EntryPMap);
+            Merged = PredPMap;
         }
     }
 }
 
+/// Variables whose psets differ in \p After, which includes all variables of \p Before.
+static SmallVector<Variable, 8> changedEntries(const PSetsMap& Before, const PSetsMap& After)
+{
+    SmallVector<Variable, 8> Changed;
+    auto I = Before.begin();
+    for (const auto& [V, PS] : After) {
+        while (I != Before.end() && I->first < V) {
+            ++I;
+        }
+        if (I == Before.end() || V < I->first || I->second != PS) {
+            Changed.push_back(V);
+        }
+    }
+    return Changed;
+}
+
 /// Initialize psets for all members of *this that are Owner or Pointers.
 /// Assume that all Pointers are valid.
 static void createEntryPsetsForMembers(const CXXMethodDecl* Method, PSetsMap& PMap)
@@ -362,14 +432,10 @@ static void createEntryPsetsForMembers(const CXXMethodDecl* Method, PSetsMap& PM
     RD->forallBases(CallBack);
 }
 
-/// Traverse all blocks of the CFG.
-/// The traversal is repeated until the psets come to a steady state.
-// NOLINTNEXTLINE(readability-function-cognitive-complexity)
+/// Traverse all blocks of the CFG in weak topological order.
+/// Loops are repeated until the psets come to a steady state.
 void LifetimeContext::traverseBlocks()
 {
-    static constexpr unsigned IterationLimit = 100000;
-
-    ForwardDataflowWorklist WorkList(*ControlFlowGraph, AC);
     // The entry block introduces the function parameters into the psets.
     auto* Start = &ControlFlowGraph->getEntry();
     auto& BC = getBlockContext(Start);
@@ -405,57 +471,149 @@ void LifetimeContext::traverseBlocks()
         createEntryPsetsForMembers(Method, BC.ExitPMap);
     }
 
-    WorkList.enqueueSuccessors(Start);
+    for (const auto& E : computeWeakTopologicalOrder(*ControlFlowGraph)) {
+        stabilize(E);
+    }
 
-    unsigned IterationCount = 0;
-    llvm::BitVector Visited(ControlFlowGraph->getNumBlockIDs());
-    const CFGBlock* Current = nullptr;
-    while ((Current = WorkList.dequeue()) && IterationCount < IterationLimit) {
-        if (Current == &ControlFlowGraph->getExit()) {
-            continue;
+    if (IterationCount > MaxBlockVisitCount) {
+        MaxBlockVisitCount = IterationCount;
+    }
+}
+
+/// Visits \p E, and if it is a loop, repeats the loop until its head is stable. Nested loops are stabilized
+/// in each round, so they are stable when the outer loop is.
+void LifetimeContext::stabilize(const WTOElement& E)
+{
+    if (!E.IsLoop) {
+        updateBlock(*E.Block, /*Widen=*/false);
+        return;
+    }
+
+    for (unsigned Round = 0;; ++Round) {
+        // The psets form a finite lattice, so loops converge without widening unless the budget is exceeded
+        const bool Widen = Round > 0 && Budget != BudgetState::Within;
+        // Every cycle in the loop goes through the head, so the body is stable once the head is
+        if (!updateBlock(*E.Block, Widen) && Round > 0) {
+            return;
+        }
+        for (const auto& Inner : E.Body) {
+            stabilize(Inner);
         }
+    }
+}
 
-        auto& BC = getBlockContext(Current);
+/// Recomputes the psets of \p B from the exit psets of its predecessors.
+/// \param Widen whether entry psets that still change are widened, see widenEntryPSets()
+/// \returns false if the entry psets did not change since the last visit
+bool LifetimeContext::updateBlock(const CFGBlock& B, bool Widen)
+{
+    if (&B == &ControlFlowGraph->getEntry() || &B == &ControlFlowGraph->getExit()) {
+        return false;
+    }
 
-        // Compute entry psets of this block by merging exit psets of all
-        // reachable predecessors.
-        const bool VisitedBefore = Visited[Current->getBlockID()];
-        auto OrigEntryPMap = BC.EntryPMap;
-        computeEntryPSets(*Current);
-        if (VisitedBefore && BC.EntryPMap == OrigEntryPMap) {
-            // Has been computed at least once and nothing changed; no need to
-            // recompute.
-            continue;
+    auto& BC = getBlockContext(&B);
+    auto OrigEntryPMap = BC.EntryPMap;
+    computeEntryPSets(B);
+    if (Widen || !BC.WidenedVars.empty()) {
+        widenEntryPSets(B, BC, OrigEntryPMap, Widen);
+    }
+    if (BC.Visited && BC.EntryPMap == OrigEntryPMap) {
+        // Has been computed at least once and nothing changed; no need to
+        // recompute.
+        return false;
+    }
+    if (!withinBudget(B)) {
+        return false;
+    }
+
+    ++BlockVisitCount;
+    ++IterationCount;
+    BC.ExitPMap = BC.EntryPMap;
+    BC.Visited = true;
+    visitBlock(FuncDecl, BC.ExitPMap, BC.FalseBranchExitPMap, ExprMemberPMap, PSetsOfExpr, RefersTo, B, Reporter,
+        ASTCtxt, IsConvertible);
+
+    if (Liveness) {
+        Liveness->pruneExit(B, BC.ExitPMap);
+        if (BC.FalseBranchExitPMap) {
+            Liveness->pruneExit(B, *BC.FalseBranchExitPMap);
         }
+    }
+    return true;
+}
 
-        ++BlockVisitCount;
-        ++IterationCount;
-        BC.ExitPMap = BC.EntryPMap;
-        Visited[Current->getBlockID()] = true;
-        visitBlock(FuncDecl, BC.ExitPMap, BC.FalseBranchExitPMap, ExprMemberPMap, PSetsOfExpr, RefersTo, *Current,
-            Reporter, ASTCtxt, IsConvertible);
-
-        if (const auto* T = Current->getTerminatorStmt()) {
-            // HACK
-            // for-statement will visit false block, which causes the false block will be visited twice
-            //
-            // <code>
-            // int* p = nullptr;
-            // for (...) p = new int{};
-            // __lifetime_pset(p);  // this block will be runned twice
-            // </code>
-            if (!VisitedBefore && isa<ForStmt>(T) && !Current->succ_empty()) {
-                CPPSAFE_ASSERT(Current->succ_size() == 2);
-                WorkList.enqueueBlock(*Current->succ_begin());
-                continue;
-            }
+/// Degrades the analysis once it exceeds the budget of block visits or time of the function: loop heads are
+/// widened after the first round, and beyond twice the budget no more blocks are visited, starting with \p B.
+/// \returns false if no more blocks may be visited
+bool LifetimeContext::withinBudget(const CFGBlock& B)
+{
+    if (Budget == BudgetState::Exhausted) {
+        return false;
+    }
+
+    const auto& Options = Reporter.getOptions();
+    const std::uint64_t Factor = Budget == BudgetState::Within ? 1 : 2;
+    std::string Exceeded;
+    if (Options.MaxBlockVisits != 0 && IterationCount >= Factor * Options.MaxBlockVisits) {
+        Exceeded = std::to_string(Options.MaxBlockVisits) + " block visits";
+    } else if (Options.FunctionTimeBudget != 0) {
+        const auto Elapsed
+            = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - StartTime);
+        if (static_cast<std::uint64_t>(Elapsed.count()) >= Factor * Options.FunctionTimeBudget) {
+            Exceeded = std::to_string(Options.FunctionTimeBudget) + " ms";
         }
+    }
+    if (Exceeded.empty()) {
+        return true;
+    }
 
-        WorkList.enqueueSuccessors(Current);
+    ExceededBudget = std::move(Exceeded);
+    if (Budget == BudgetState::Within) {
+        // Reported once a loop is actually widened, see widenEntryPSets()
+        Budget = BudgetState::Degraded;
+        return true;
     }
 
-    if (IterationCount > MaxBlockVisitCount) {
-        MaxBlockVisitCount = IterationCount;
+    Budget = BudgetState::Exhausted;
+    remarkBudgetExceeded(B, /*Skipped=*/true);
+    return false;
+}
+
+/// Reports at \p B that the budget is exceeded, and whether the rest of the function is skipped from there on
+/// or the loop headed by \p B is widened.
+void LifetimeContext::remarkBudgetExceeded(const CFGBlock& B, bool Skipped)
+{
+    auto Loc = getStartLocOfBlock(B);
+    if (Loc.isInvalid()) {
+        Loc = FuncDecl->getLocation();
+    }
+    Reporter.remarkBudgetExceeded(Loc, FuncDecl->getQualifiedNameAsString(), ExceededBudget, Skipped);
+}
+
+/// Widens the entry psets of a loop head that still change once the analysis exceeded its budget, so that the
+/// loop converges in the next round. Their psets become unknown, which hides the warnings of these pointers
+/// rather than reporting wrong ones. Widened variables stay widened, as the back edges add their pointees again.
+/// \param Extend whether variables whose psets changed since \p OrigEntryPMap are widened
+void LifetimeContext::widenEntryPSets(const CFGBlock& B, BlockContext& BC, const PSetsMap& OrigEntryPMap, bool Extend)
+{
+    if (Extend) {
+        bool Extended = false;
+        for (const auto& V : changedEntries(OrigEntryPMap, BC.EntryPMap)) {
+            Extended |= BC.WidenedVars.insert(V.getId()).second;
+        }
+        if (Extended && !ReportedWidening) {
+            ReportedWidening = true;
+            remarkBudgetExceeded(B, /*Skipped=*/false);
+        }
+    }
+
+    const PSetsMap& Entry = BC.EntryPMap;
+    for (const auto Id : BC.WidenedVars) {
+        const auto V = Variable::fromId(Id);
+        auto It = Entry.find(V);
+        if (It != Entry.end() && !It->second.isUnknown()) {
+            BC.EntryPMap[V].widen();
+        }
     }
 }
 
@@ -498,22 +656,21 @@ static bool shouldSuppressLifetime(const FunctionDecl* Func)
 }
 
 /// Check that the function adheres to the lifetime profile.
-void runAnalysis(
-    const FunctionDecl* Func, ASTContext& Context, LifetimeReporterBase& Reporter, IsConvertibleTy IsConvertible)
+bool shouldAnalyze(const FunctionDecl* Func)
 {
     if (!Func->doesThisDeclarationHaveABody()) {
-        return;
+        return false;
     }
     if (Func->isInStdNamespace()) {
-        return;
+        return false;
     }
     if (shouldSuppressLifetime(Func)) {
-        return;
+        return false;
     }
     if (const auto* DC = Func->getEnclosingNamespaceContext()) {
         if (const auto* NS = dyn_cast<NamespaceDecl>(DC)) {
             if (NS->getIdentifier() && NS->getName() == "gsl") {
-                return;
+                return false;
             }
         }
     }
@@ -522,19 +679,53 @@ void runAnalysis(
         // Do not check the bodies of methods on Owners.
         auto Class = classifyTypeCategory(M->getParent()->getTypeForDecl());
         if (Class.TC == TypeCategory::Owner) {
-            return;
+            return false;
         }
     }
 
+    return true;
+}
+
+void runAnalysis(
+    const FunctionDecl* Func, ASTContext& Context, LifetimeReporterBase& Reporter, IsConvertibleTy IsConvertible)
+{
+    if (!shouldAnalyze(Func)) {
+        return;
+    }
+
+    const AnalysisMemoryScope Memory;
     LifetimeContext LC(Context, Reporter, Func, IsConvertible);
     LC.traverseBlocks();
 }
 
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): see AnalysisMemoryScope
+static thread_local std::pmr::memory_resource* AnalysisMemory = nullptr;
+
+std::pmr::memory_resource* getAnalysisMemory()
+{
+    return AnalysisMemory ? AnalysisMemory : std::pmr::get_default_resource();
+}
+
+AnalysisMemoryScope::AnalysisMemoryScope()
+    : Previous(AnalysisMemory)
+{
+    AnalysisMemory = &Pool;
+}
+
+AnalysisMemoryScope::~AnalysisMemoryScope() { AnalysisMemory = Previous; }
+
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): hack
-static Sema* CachedSema = nullptr;
+static thread_local Sema* CachedSema = nullptr;
 
 gsl::not_null<Sema*> getSema() { return CachedSema; }
 
 void setSema(Sema* S) { CachedSema = S; }
 
+void clearCaches()
+{
+    clearTypeCategoryCaches();
+    clearLifetimeContractCache();
+    VariableTable::get().clear();
+}
+
 } // namespace clang
@@ -551,10 +551,14 @@ static void copyContract4Derived(
     }
 }
 
+// Keyed by decls of the current TU, see clearTypeCategoryCaches() for why it is per thread
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): per-TU cache
+static thread_local std::map<const FunctionDecl*, LifetimeContractAttr> ContractCache;
+
+void clearLifetimeContractCache() { ContractCache.clear(); }
+
 static LifetimeContractAttr* getLifetimeContracts(const FunctionDecl* FD)
 {
-    static std::map<const FunctionDecl*, LifetimeContractAttr> ContractCache;
-
     FD = FD->getCanonicalDecl();
     auto It = ContractCache.find(FD);
     if (It == ContractCache.end()) {
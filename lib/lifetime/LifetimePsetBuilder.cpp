@@ -36,6 +36,7 @@
 #include <clang/Basic/SourceLocation.h>
 #include <clang/Lex/Lexer.h>
 #include <llvm/ADT/APInt.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/STLFunctionalExtras.h>
 #include <llvm/ADT/SmallVector.h>
@@ -43,6 +44,7 @@
 #include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
 #include <functional>
 #include <map>
 #include <optional>
@@ -67,6 +69,149 @@ inline bool isPointer(const Expr* E)
     return TC == TypeCategory::Pointer;
 }
 
+/// Finds the entries of a PSetsMap that involve a base variable or temporaries without scanning the whole map.
+///
+/// Entries are recorded when a pset is stored, but not forgotten when it changes or is erased, so the
+/// candidates must be looked up in the map again.
+class PSetsMapIndex {
+public:
+    using Keys = SmallVector<Variable, 8>;
+
+    explicit PSetsMapIndex(const PSetsMap& PMap)
+    {
+        for (const auto& [Key, PS] : PMap) {
+            add(Key, PS);
+        }
+    }
+
+    void add(const Variable& Key, const PSet& PS)
+    {
+        auto& Table = VariableTable::get();
+        append(KeysByBase[Table.getBaseId(Key.getId())], Key);
+        if (const auto* MTE = Key.asTemporary()) {
+            append(TemporariesByExtendingDecl[MTE->getExtendingDecl()], Key);
+        }
+        for (const auto& V : PS.vars()) {
+            append(KeysByPointee[Table.getBaseId(V.getId())], Key);
+            if (const auto* MTE = V.asTemporary()) {
+                append(KeysByPointeeExtendingDecl[MTE->getExtendingDecl()], Key);
+            }
+        }
+    }
+
+    /// Keys with the base of \p V, in map order.
+    Keys keysWithBaseOf(const Variable& V) const { return lookup(KeysByBase, baseOf(V)); }
+
+    /// Keys whose pset may contain a variable with the base of \p V, in map order.
+    Keys keysPointingToBaseOf(const Variable& V) const { return lookup(KeysByPointee, baseOf(V)); }
+
+    /// Keys that are temporaries extended by \p VD, or not extended if it is null, in map order.
+    Keys temporariesExtendedBy(const ValueDecl* VD) const { return lookup(TemporariesByExtendingDecl, VD); }
+
+    /// Keys whose pset may contain a temporary extended by \p VD, or not extended if it is null, in map order.
+    Keys keysPointingToTemporariesExtendedBy(const ValueDecl* VD) const
+    {
+        return lookup(KeysByPointeeExtendingDecl, VD);
+    }
+
+private:
+    template <class K> using Index = llvm::DenseMap<K, SmallVector<Variable, 2>>;
+
+    static VariableTable::Id baseOf(const Variable& V) { return VariableTable::get().getBaseId(V.getId()); }
+
+    static void append(SmallVector<Variable, 2>& To, const Variable& Key)
+    {
+        if (To.empty() || To.back() != Key) {
+            To.push_back(Key);
+        }
+    }
+
+    template <class K> static Keys lookup(const Index<K>& I, K Key)
+    {
+        Keys Result;
+        const auto It = I.find(Key);
+        if (It != I.end()) {
+            Result.assign(It->second.begin(), It->second.end());
+            llvm::sort(Result);
+            Result.erase(std::unique(Result.begin(), Result.end()), Result.end());
+        }
+        return Result;
+    }
+
+    Index<VariableTable::Id> KeysByBase;
+    Index<VariableTable::Id> KeysByPointee;
+    Index<const ValueDecl*> TemporariesByExtendingDecl;
+    Index<const ValueDecl*> KeysByPointeeExtendingDecl;
+};
+
+/// The lookups of PSetsMapIndex, answered by scanning the map while no index is built. A single cleanup is
+/// cheaper as a scan than building the index first.
+class PSetsMapLookup {
+public:
+    using Keys = PSetsMapIndex::Keys;
+
+    PSetsMapLookup(const PSetsMap& PMap, const PSetsMapIndex* Index)
+        : PMap(PMap)
+        , Index(Index)
+    {
+    }
+
+    Keys keysWithBaseOf(const Variable& V) const
+    {
+        if (Index) {
+            return Index->keysWithBaseOf(V);
+        }
+        const auto Base = baseOf(V);
+        return scan([Base](const Variable& Key, const PSet&) { return baseOf(Key) == Base; });
+    }
+
+    Keys keysPointingToBaseOf(const Variable& V) const
+    {
+        if (Index) {
+            return Index->keysPointingToBaseOf(V);
+        }
+        const auto Base = baseOf(V);
+        return scan([Base](const Variable&, const PSet& PS) {
+            return llvm::any_of(PS.vars(), [Base](const Variable& P) { return baseOf(P) == Base; });
+        });
+    }
+
+    Keys temporariesExtendedBy(const ValueDecl* VD) const
+    {
+        if (Index) {
+            return Index->temporariesExtendedBy(VD);
+        }
+        return scan([VD](const Variable& Key, const PSet&) { return Key.isTemporaryExtendedBy(VD); });
+    }
+
+    Keys keysPointingToTemporariesExtendedBy(const ValueDecl* VD) const
+    {
+        if (Index) {
+            return Index->keysPointingToTemporariesExtendedBy(VD);
+        }
+        return scan([VD](const Variable&, const PSet& PS) {
+            return llvm::any_of(PS.vars(), [VD](const Variable& P) { return P.isTemporaryExtendedBy(VD); });
+        });
+    }
+
+private:
+    static VariableTable::Id baseOf(const Variable& V) { return VariableTable::get().getBaseId(V.getId()); }
+
+    template <class Fn> Keys scan(const Fn& Matches) const
+    {
+        Keys Result;
+        for (const auto& [Key, PS] : PMap) {
+            if (Matches(Key, PS)) {
+                Result.push_back(Key);
+            }
+        }
+        return Result;
+    }
+
+    const PSetsMap& PMap;
+    const PSetsMapIndex* Index;
+};
+
 /// Collection of methods to update/check PSets from statements/expressions
 /// Conceptually, for each Expr where Expr::isLValue() is true,
 /// we put an entry into the RefersTo map, which contains the set
@@ -94,10 +239,35 @@ class PSetsBuilder final : public ConstStmtVisitor<PSetsBuilder, void>, public P
     /// MaterializedTemporaryExpr plus (optional) FieldDecls.
     PSetsMap& PMap;
     PSetsMap& ExprMemberPMap;
-    std::map<const Expr*, PSet>& PSetsOfExpr;
-    std::map<const Expr*, PSet>& RefersTo;
+    ExprPSetsMap& PSetsOfExpr;
+    ExprPSetsMap& RefersTo;
     const CFGBlock* CurrentBlock = nullptr;
 
+    /// Index of PMap, built on the second cleanup or invalidation of a visit, the first one scans PMap.
+    /// Every store into PMap must go through indexPSet().
+    mutable std::optional<PSetsMapIndex> PMapIndex;
+    bool ScannedPMap = false;
+
+    /// Lookups for one cleanup or invalidation
+    PSetsMapLookup lookupPMap()
+    {
+        if (!PMapIndex && !ScannedPMap) {
+            ScannedPMap = true;
+            return { PMap, nullptr };
+        }
+        if (!PMapIndex) {
+            PMapIndex.emplace(PMap);
+        }
+        return { PMap, &*PMapIndex };
+    }
+
+    void indexPSet(const Variable& Key, const PSet& PS) const
+    {
+        if (PMapIndex) {
+            PMapIndex->add(Key, PS);
+        }
+    }
+
 public:
     /// Ignore parentheses and most implicit casts.
     /// Does not go through implicit cast that convert a literal into a pointer,
@@ -848,7 +1018,18 @@ public:
 
     void invalidateVar(const Variable& V, const InvalidationReason& Reason) override
     {
-        for (const auto& [Var, PS] : PMap) {
+        invalidateVar(V, Reason, lookupPMap());
+    }
+
+    void invalidateVar(const Variable& V, const InvalidationReason& Reason, const PSetsMapLookup& Lookup)
+    {
+        const PSetsMap& ConstPMap = PMap;
+        for (const auto& Var : Lookup.keysPointingToBaseOf(V)) {
+            const auto I = ConstPMap.find(Var);
+            if (I == ConstPMap.end()) {
+                continue;
+            }
+            const PSet& PS = I->second;
             if (PS.containsInvalid()) {
                 continue; // Nothing to invalidate
             }
@@ -879,12 +1060,17 @@ public:
 
     void invalidateOwner(const Variable& V, const InvalidationReason& Reason) override
     {
-        for (const auto& I : PMap) {
-            const auto& Var = I.first;
+        const auto Lookup = lookupPMap();
+        const PSetsMap& ConstPMap = PMap;
+        for (const auto& Var : Lookup.keysPointingToBaseOf(V)) {
             if (V == Var) {
                 continue; // Invalidating Owner' should not change the pset of Owner
             }
-            const PSet& PS = I.second;
+            const auto I = ConstPMap.find(Var);
+            if (I == ConstPMap.end()) {
+                continue;
+            }
+            const PSet& PS = I->second;
             if (PS.containsInvalid()) {
                 continue; // Nothing to invalidate
             }
@@ -910,10 +1096,11 @@ public:
             }
         }
 
-        std::erase_if(PMap, [&V](const auto& Item) {
-            const Variable& Var = Item.first;
-            return V != Var && Var.isField() && V.isParent(Var);
-        });
+        for (const auto& Var : Lookup.keysWithBaseOf(V)) {
+            if (V != Var && Var.isField() && V.isParent(Var)) {
+                PMap.erase(Var);
+            }
+        }
     }
 
     const CFGBlock* getCurrentBlock() override { return CurrentBlock; }
@@ -929,26 +1116,109 @@ public:
     {
         const InvalidationReason Reason = VD ? InvalidationReason::pointeeLeftScope(Range, CurrentBlock, VD)
                                              : InvalidationReason::temporaryLeftScope(Range, CurrentBlock);
+        const auto Lookup = lookupPMap();
         if (VD) {
-            std::erase_if(PMap, [VD](const auto& E) { return Variable(VD).isParent(E.first); });
-            invalidateVar(VD, Reason);
+            const Variable V(VD);
+            for (const auto& Var : Lookup.keysWithBaseOf(V)) {
+                if (V.isParent(Var)) {
+                    PMap.erase(Var);
+                }
+            }
+            invalidateVar(V, Reason, Lookup);
         }
         // Remove all materialized temporaries that were extended by this
         // variable (or a lifetime extended temporary without an extending
         // declaration) and do the invalidation.
-        for (auto I = PMap.begin(); I != PMap.end();) {
-            if (I->first.isTemporaryExtendedBy(VD)) {
-                I = PMap.erase(I);
-            } else {
-                const auto& Var = I->first;
-                auto& Pset = I->second;
-                const bool PsetContainsTemporary
-                    = llvm::any_of(Pset.vars(), [VD](const Variable& V) { return V.isTemporaryExtendedBy(VD); });
-                if (PsetContainsTemporary) {
-                    setPSet(PSet::singleton(Var), PSet::invalid(Reason), Reason.getRange());
+        for (const auto& Var : Lookup.temporariesExtendedBy(VD)) {
+            PMap.erase(Var);
+        }
+        const PSetsMap& ConstPMap = PMap;
+        for (const auto& Var : Lookup.keysPointingToTemporariesExtendedBy(VD)) {
+            const auto I = ConstPMap.find(Var);
+            if (I == ConstPMap.end()) {
+                continue;
+            }
+            const bool PsetContainsTemporary
+                = llvm::any_of(I->second.vars(), [VD](const Variable& V) { return V.isTemporaryExtendedBy(VD); });
+            if (PsetContainsTemporary) {
+                setPSet(PSet::singleton(Var), PSet::invalid(Reason), Reason.getRange());
+            }
+        }
+    }
+
+    /// A variable leaving scope, and where.
+    using LeavingVar = std::pair<const VarDecl*, SourceRange>;
+
+    /// Same as calling eraseVariable() on each of \p Vars in order, but with a single pass over PMap.
+    void eraseVariables(ArrayRef<LeavingVar> Vars)
+    {
+        if (Vars.size() == 1) {
+            eraseVariable(Vars.front().first, Vars.front().second);
+            return;
+        }
+
+        // Index of the first var with the given base or extending the given temporaries
+        llvm::SmallDenseMap<VariableTable::Id, unsigned, 16> ByBase;
+        llvm::SmallDenseMap<const ValueDecl*, unsigned, 16> ByDecl;
+        SmallVector<Variable, 16> Leavers;
+        for (unsigned I = 0; I < Vars.size(); ++I) {
+            Leavers.emplace_back(Vars[I].first);
+            ByBase.try_emplace(VariableTable::get().getBaseId(Leavers.back().getId()), I);
+            ByDecl.try_emplace(Vars[I].first, I);
+        }
+
+        const auto Lookup = [](const auto& Map, const auto& Key) -> std::optional<unsigned> {
+            const auto It = Map.find(Key);
+            if (It == Map.end()) {
+                return std::nullopt;
+            }
+            return It->second;
+        };
+        // The var whose leaving scope erases Var
+        const auto ErasedBy = [&](const Variable& Var) -> std::optional<unsigned> {
+            if (const auto I = Lookup(ByBase, VariableTable::get().getBaseId(Var.getId()));
+                I && Leavers[*I].isParent(Var)) {
+                return I;
+            }
+            if (const auto* MTE = Var.asTemporary()) {
+                return Lookup(ByDecl, MTE->getExtendingDecl());
+            }
+            return std::nullopt;
+        };
+
+        // eraseVariable() skips invalid psets for the var itself, but not for its temporaries
+        SmallVector<Variable, 16> Erased;
+        SmallVector<std::pair<Variable, unsigned>, 16> Invalidated;
+        const PSetsMap& ConstPMap = PMap;
+        for (const auto& [Var, PS] : ConstPMap) {
+            if (ErasedBy(Var)) {
+                Erased.push_back(Var);
+                continue;
+            }
+
+            std::optional<unsigned> First;
+            for (const auto& V : PS.vars()) {
+                auto I = ErasedBy(V);
+                if (I && PS.containsInvalid() && !V.asTemporary()) {
+                    I = std::nullopt;
+                }
+                if (I && (!First || *I < *First)) {
+                    First = I;
                 }
-                ++I;
             }
+            if (First) {
+                Invalidated.emplace_back(Var, *First);
+            }
+        }
+
+        // In the order eraseVariable() would invalidate them
+        llvm::stable_sort(Invalidated, [](const auto& L, const auto& R) { return L.second < R.second; });
+        for (const auto& [Var, I] : Invalidated) {
+            const auto Reason = InvalidationReason::pointeeLeftScope(Vars[I].second, CurrentBlock, Vars[I].first);
+            setPSet(PSet::singleton(Var), PSet::invalid(Reason), Reason.getRange());
+        }
+        for (const auto& Var : Erased) {
+            PMap.erase(Var);
         }
     }
 
@@ -1050,6 +1320,7 @@ public:
             ExprMemberPMap.insert_or_assign(std::move(V), PS);
         } else {
             PMap[V] = PS;
+            indexPSet(V, PS);
         }
     }
 
@@ -1252,7 +1523,7 @@ public:
 
 public:
     PSetsBuilder(const FunctionDecl* FD, LifetimeReporterBase& Reporter, ASTContext& ASTCtxt, PSetsMap& PMap,
-        PSetsMap& ExprMemberPMap, std::map<const Expr*, PSet>& PSetsOfExpr, std::map<const Expr*, PSet>& RefersTo,
+        PSetsMap& ExprMemberPMap, ExprPSetsMap& PSetsOfExpr, ExprPSetsMap& RefersTo,
         IsConvertibleTy IsConvertible)
         : AnalyzedFD(FD)
         , Reporter(Reporter)
@@ -1325,6 +1596,7 @@ PSet PSetsBuilder::getPSet(const Variable& P) const
     if (P.isField()) {
         auto PS = getPSetOfField(P);
         PMap[P] = PS;
+        indexPSet(P, PS);
         return PS;
     }
 
@@ -1452,6 +1724,7 @@ void PSetsBuilder::setPSet(const PSet& LHS, PSet RHS, SourceRange Range)
     if (LHS.vars().size() == 1) {
         const Variable Var = *LHS.vars().begin();
         RHS.addReasonTarget(Var);
+        indexPSet(Var, RHS);
         auto I = PMap.find(Var);
         if (I != PMap.end()) {
             I->second = std::move(RHS);
@@ -1460,6 +1733,7 @@ void PSetsBuilder::setPSet(const PSet& LHS, PSet RHS, SourceRange Range)
         }
     } else {
         for (const auto& V : LHS.vars()) {
+            indexPSet(V, RHS);
             auto I = PMap.find(V);
             if (I != PMap.end()) {
                 I->second.merge(RHS);
@@ -1740,7 +2014,21 @@ static SourceRange getSourceRange(const CFGElement& E)
 void PSetsBuilder::visitBlock(const CFGBlock& B, std::optional<PSetsMap>& FalseBranchExitPMap)
 {
     CurrentBlock = &B;
+
+    // Variables leave scope in runs, e.g. at the end of a block, process each run at once
+    SmallVector<LeavingVar, 8> LeavingVars;
+    const auto FlushLeavingVars = [&] {
+        if (!LeavingVars.empty()) {
+            eraseVariables(LeavingVars);
+            LeavingVars.clear();
+        }
+    };
+
     for (const auto& E : B) {
+        if (E.getKind() != CFGElement::LifetimeEnds) {
+            FlushLeavingVars();
+        }
+
         switch (E.getKind()) {
         case CFGElement::Statement: {
             const Stmt* S = E.castAs<CFGStmt>().getStmt();
@@ -1792,13 +2080,15 @@ void PSetsBuilder::visitBlock(const CFGBlock& B, std::optional<PSetsMap>& FalseB
             if (const auto* RD = VD->getType()->getAsCXXRecordDecl()) {
                 if (const auto* Dtor = RD->getDestructor()) {
                     if (isAnnotatedWith(Dtor, LifetimePre)) {
+                        // Must see the variables that left scope before
+                        FlushLeavingVars();
                         checkPSetValidity(getPSet(VD), Leaver.getTriggerStmt()->getEndLoc());
                     }
                 }
             }
 
             // Stop tracking Variables that leave scope.
-            eraseVariable(VD, Leaver.getTriggerStmt()->getEndLoc());
+            LeavingVars.emplace_back(VD, Leaver.getTriggerStmt()->getEndLoc());
             break;
         }
         case CFGElement::NewAllocator:
@@ -1826,6 +2116,8 @@ void PSetsBuilder::visitBlock(const CFGBlock& B, std::optional<PSetsMap>& FalseB
             break;
         }
     }
+    FlushLeavingVars();
+
     if (const auto* Terminator = getRealTerminator(B)) {
         updatePSetsFromCondition(Terminator, /*Positive=*/true, FalseBranchExitPMap, Terminator->getEndLoc());
     }
@@ -1895,6 +2187,7 @@ void PSetsBuilder::onFunctionFinish(const CFGBlock& B)
 
             return *It->second.vars().begin();
         });
+        indexPSet(OutVarIt->first, OutVarIt->second);
 
         OutVarIt->second.checkSubstitutableFor(
             OutPSetInPostCond, Range, Reporter, ValueSource::OutputParam, OutVarInPostCond.getName());
@@ -1938,7 +2231,7 @@ void PSetsBuilder::onFunctionFinish(const CFGBlock& B)
 } // namespace lifetime
 
 bool visitBlock(const FunctionDecl* FD, PSetsMap& PMap, std::optional<PSetsMap>& FalseBranchExitPMap,
-    PSetsMap& ExprMemberPMap, std::map<const Expr*, PSet>& PSetsOfExpr, std::map<const Expr*, PSet>& RefersTo,
+    PSetsMap& ExprMemberPMap, ExprPSetsMap& PSetsOfExpr, ExprPSetsMap& RefersTo,
     const CFGBlock& B, LifetimeReporterBase& Reporter, ASTContext& ASTCtxt, IsConvertibleTy IsConvertible)
 {
     Reporter.setCurrentBlock(&B);
@@ -40,6 +40,24 @@ namespace clang::lifetime {
 
 static QualType getPointeeType(const Type* T);
 
+namespace {
+
+/// All caches are keyed by AST nodes owned by the ASTContext of the TU being analyzed.
+/// A TU is always analyzed by a single thread, so the caches are per thread and must be
+/// dropped before the next TU reuses the addresses, see clearTypeCategoryCaches().
+struct TypeCategoryCaches {
+    std::map<const Type*, TypeClassification> Category;
+    std::map<const Type*, bool> IteratorOrContainer;
+    std::map<const Type*, QualType> Pointee;
+};
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): per-TU cache
+thread_local TypeCategoryCaches Caches;
+
+} // namespace
+
+void clearTypeCategoryCaches() { Caches = {}; }
+
 template <typename T>
 static bool hasMethodLike(const CXXRecordDecl* R, T Predicate, const CXXMethodDecl** FoundMD = nullptr)
 {
@@ -367,7 +385,7 @@ static TypeClassification classifyTypeCategoryImpl(const Type* T)
 
 TypeClassification classifyTypeCategory(const Type* T)
 {
-    static std::map<const Type*, TypeClassification> Cache;
+    auto& Cache = Caches.Category;
     T = T->getUnqualifiedDesugaredType();
 
     auto I = Cache.find(T);
@@ -389,7 +407,7 @@ bool isIteratorOrContainer(QualType QT)
         return false;
     }
 
-    static std::map<const Type*, bool> Cache;
+    auto& Cache = Caches.IteratorOrContainer;
     const auto* RawT = QT.getTypePtr();
     const auto* T = RawT->getUnqualifiedDesugaredType();
     auto It = Cache.find(T);
@@ -575,7 +593,7 @@ static QualType getPointeeType(const Type* T)
 {
     assert(T);
     T = T->getCanonicalTypeUnqualified().getTypePtr();
-    static std::map<const Type*, QualType> M;
+    auto& M = Caches.Pointee;
 
     auto I = M.find(T);
     if (I != M.end()) {
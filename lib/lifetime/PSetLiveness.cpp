@@ -0,0 +1,224 @@
+#include "cppsafe/lifetime/PSetLiveness.h"
+
+#include <clang/AST/Decl.h>
+#include <clang/AST/DeclCXX.h>
+#include <clang/AST/Expr.h>
+#include <clang/AST/ExprCXX.h>
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Analysis/CFG.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace clang::lifetime {
+
+namespace {
+
+/// Local variables whose every use is read or assigned, see PSetLiveness.
+class TrackedVarCollector : public RecursiveASTVisitor<TrackedVarCollector> {
+public:
+    // Implicit uses, e.g. of the variables of a range-based for, count as well
+    bool shouldVisitImplicitCode() const { return true; }
+
+    bool VisitVarDecl(VarDecl* D)
+    {
+        if (D->hasLocalStorage() && !isa<ParmVarDecl>(D) && !isa<DecompositionDecl>(D)) {
+            Locals.push_back(D);
+        }
+        return true;
+    }
+
+    bool VisitImplicitCastExpr(ImplicitCastExpr* E)
+    {
+        if (E->getCastKind() == CK_LValueToRValue) {
+            addPlainUse(E->getSubExpr());
+        }
+        return true;
+    }
+
+    bool VisitBinaryOperator(BinaryOperator* E)
+    {
+        if (E->getOpcode() == BO_Assign) {
+            addPlainUse(E->getLHS());
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr* E)
+    {
+        Uses.push_back(E);
+        return true;
+    }
+
+    bool VisitLambdaExpr(LambdaExpr* E)
+    {
+        for (const auto& C : E->captures()) {
+            if (C.capturesVariable()) {
+                Escaping.insert(C.getCapturedVar());
+            }
+        }
+        return true;
+    }
+
+    llvm::SmallVector<const VarDecl*, 16> getTracked()
+    {
+        for (const auto* Use : Uses) {
+            if (!PlainUses.contains(Use)) {
+                Escaping.insert(Use->getDecl());
+            }
+        }
+        return llvm::to_vector(llvm::make_filter_range(Locals, [this](const VarDecl* D) {
+            return !Escaping.contains(D);
+        }));
+    }
+
+private:
+    void addPlainUse(const Expr* E)
+    {
+        if (const auto* DRE = dyn_cast<DeclRefExpr>(E->IgnoreParens())) {
+            PlainUses.insert(DRE);
+        }
+    }
+
+    llvm::SmallVector<const VarDecl*, 16> Locals;
+    llvm::SmallVector<const DeclRefExpr*, 32> Uses;
+    llvm::SmallPtrSet<const DeclRefExpr*, 32> PlainUses;
+    llvm::SmallPtrSet<const ValueDecl*, 16> Escaping;
+};
+
+} // namespace
+
+PSetLiveness::PSetLiveness(const CFG& Cfg, const FunctionDecl& FD)
+{
+    TrackedVarCollector Collector;
+    Collector.TraverseDecl(const_cast<FunctionDecl*>(&FD)); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+    for (const auto* D : Collector.getTracked()) {
+        Tracked.try_emplace(D, Tracked.size());
+    }
+    if (Tracked.empty()) {
+        return;
+    }
+
+    const auto TrackedIndex = [this](const Decl* D) -> std::optional<unsigned> {
+        const auto* VD = dyn_cast_or_null<VarDecl>(D);
+        auto It = VD ? Tracked.find(VD) : Tracked.end();
+        return It != Tracked.end() ? std::make_optional(It->second) : std::nullopt;
+    };
+
+    // Variables read in a block before being declared there, and variables declared there
+    const auto NumBlocks = Cfg.getNumBlockIDs();
+    std::vector<llvm::BitVector> Gen(NumBlocks, llvm::BitVector(Tracked.size()));
+    std::vector<llvm::BitVector> Kill(NumBlocks, llvm::BitVector(Tracked.size()));
+    for (const auto* B : Cfg) {
+        auto& BlockGen = Gen[B->getBlockID()];
+        auto& BlockKill = Kill[B->getBlockID()];
+        for (const auto& E : llvm::reverse(*B)) {
+            if (auto S = E.getAs<CFGStmt>()) {
+                if (const auto* DRE = dyn_cast<DeclRefExpr>(S->getStmt())) {
+                    if (auto I = TrackedIndex(DRE->getDecl())) {
+                        BlockGen.set(*I);
+                    }
+                } else if (const auto* DS = dyn_cast<DeclStmt>(S->getStmt())) {
+                    for (const auto* D : DS->decls()) {
+                        if (auto I = TrackedIndex(D)) {
+                            BlockKill.set(*I);
+                            BlockGen.reset(*I);
+                        }
+                    }
+                }
+            } else if (auto L = E.getAs<CFGLifetimeEnds>()) {
+                // Destructors may check the pset of the variable when it leaves scope
+                const auto* RD = L->getVarDecl()->getType()->getAsCXXRecordDecl();
+                if (RD && RD->getDestructor()) {
+                    if (auto I = TrackedIndex(L->getVarDecl())) {
+                        BlockGen.set(*I);
+                    }
+                }
+            }
+        }
+    }
+
+    // Blocks are created backwards, so their ids roughly decrease along the edges and the CFG lists them in
+    // an order that suits a backward analysis
+    LiveOut.assign(NumBlocks, llvm::BitVector(Tracked.size()));
+    std::vector<llvm::BitVector> LiveIn(NumBlocks, llvm::BitVector(Tracked.size()));
+    for (bool Changed = true; Changed;) {
+        Changed = false;
+        for (const auto* B : Cfg) {
+            const auto Id = B->getBlockID();
+            auto& Out = LiveOut[Id];
+            for (const CFGBlock* Succ : B->succs()) {
+                if (Succ) {
+                    Out |= LiveIn[Succ->getBlockID()];
+                }
+            }
+
+            auto In = Out;
+            In.reset(Kill[Id]);
+            In |= Gen[Id];
+            if (In != LiveIn[Id]) {
+                LiveIn[Id] = std::move(In);
+                Changed = true;
+            }
+        }
+    }
+}
+
+void PSetLiveness::pruneExit(const CFGBlock& B, PSetsMap& PMap) const
+{
+    if (Tracked.empty()) {
+        return;
+    }
+
+    const auto& Live = LiveOut[B.getBlockID()];
+    auto& Table = VariableTable::get();
+
+    // The entries of dead variables by base, and the psets of the kept entries
+    llvm::DenseMap<VariableTable::Id, llvm::SmallVector<PSetsMap::const_iterator, 2>> Dead;
+    llvm::SmallVector<const PSet*, 32> Kept;
+    const PSetsMap& ConstPMap = PMap;
+    for (auto It = ConstPMap.begin(); It != ConstPMap.end(); ++It) {
+        const auto* VD = It->first.asVarDecl();
+        auto I = VD ? Tracked.find(VD) : Tracked.end();
+        if (I != Tracked.end() && !Live.test(I->second)) {
+            Dead[Table.getBaseId(It->first.getId())].push_back(It);
+        } else {
+            Kept.push_back(&It->second);
+        }
+    }
+    if (Dead.empty()) {
+        return;
+    }
+
+    // Psets are looked up through the psets pointing into them, e.g. when dereferencing
+    while (!Kept.empty() && !Dead.empty()) {
+        const auto* PS = Kept.pop_back_val();
+        for (const auto& V : PS->vars()) {
+            auto It = Dead.find(Table.getBaseId(V.getId()));
+            if (It == Dead.end()) {
+                continue;
+            }
+            for (const auto& Entry : It->second) {
+                Kept.push_back(&Entry->second);
+            }
+            Dead.erase(It);
+        }
+    }
+
+    llvm::SmallVector<Variable, 16> Erased;
+    for (const auto& Entries : llvm::make_second_range(Dead)) {
+        for (const auto& Entry : Entries) {
+            Erased.push_back(Entry->first);
+        }
+    }
+    for (const auto& V : Erased) {
+        PMap.erase(V);
+    }
+}
+
+} // namespace clang::lifetime
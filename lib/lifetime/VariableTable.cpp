@@ -0,0 +1,139 @@
+#include "cppsafe/lifetime/VariableTable.h"
+
+#include "cppsafe/lifetime/LifetimeTypeCategory.h"
+#include "cppsafe/util/assert.h"
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/ExprCXX.h>
+
+#include <limits>
+
+namespace clang::lifetime {
+
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): per-TU cache, see clearCaches()
+thread_local VariableTable Table;
+
+QualType getBaseType(const VariableBase& Base)
+{
+    if (const auto* VD = Base.dyn_cast<const VarDecl*>()) {
+        return VD->getType();
+    }
+    if (const auto* BD = Base.dyn_cast<const BindingDecl*>()) {
+        return BD->getType();
+    }
+    if (const auto* RD = Base.dyn_cast<const RecordDecl*>()) {
+        return RD->getASTContext().getPointerType(RD->getASTContext().getRecordType(RD));
+    }
+    if (const auto* E = Base.dyn_cast<const Expr*>()) {
+        return E->getType();
+    }
+    if (const auto* FD = Base.dyn_cast<const FunctionDecl*>()) {
+        return FD->getReturnType();
+    }
+
+    CPPSAFE_ASSERT(!"Invalid state");
+}
+
+}
+
+VariableTable& VariableTable::get() { return Table; }
+
+VariableTable::Id VariableTable::getRoot(const VariableBase& Base)
+{
+    const auto [It, Inserted] = Roots.try_emplace({ Base.index(), Base.getOpaqueValue() }, 0);
+    if (Inserted) {
+        CPPSAFE_ASSERT(Entries.size() < std::numeric_limits<Id>::max());
+        It->second = static_cast<Id>(Entries.size());
+        Entries.push_back({ Base, It->second, It->second, {} });
+    }
+    return It->second;
+}
+
+VariableTable::Id VariableTable::getChild(Id Parent, const FieldDecl* FD)
+{
+    const auto [It, Inserted] = Children.try_emplace({ Parent, FD }, 0);
+    if (Inserted) {
+        CPPSAFE_ASSERT(Entries.size() < std::numeric_limits<Id>::max());
+        It->second = static_cast<Id>(Entries.size());
+
+        Entry Child = Entries[Parent];
+        Child.Parent = Parent;
+        Child.Path.push_back(FD);
+        Entries.push_back(std::move(Child));
+    }
+    return It->second;
+}
+
+VariableTable::Id VariableTable::getWithBase(Id V, const VariableBase& Base)
+{
+    Id Result = getRoot(Base);
+    for (const auto* FD : Entries[V].Path) {
+        Result = getChild(Result, FD);
+    }
+    return Result;
+}
+
+const VariableTable::Info& VariableTable::getInfo(Id V)
+{
+    auto& Cached = Entries[V].CachedInfo;
+    if (!Cached) {
+        Cached = computeInfo(V);
+    }
+    return *Cached;
+}
+
+VariableTable::Info VariableTable::computeInfo(Id V)
+{
+    const auto& E = Entries[V];
+    if (E.Path.empty()) {
+        const auto Ty = getBaseType(E.Base);
+        return { Ty, classifyTypeCategory(Ty).isOwner() ? 0 : -1, 0, false, false };
+    }
+
+    // Parents have smaller ids, so this recursion is bounded by the path length and usually hits the cache
+    Info Result = getInfo(E.Parent);
+    if (const auto* FD = E.Path.back()) {
+        Result.Type = FD->getType();
+        const auto TC = classifyTypeCategory(Result.Type);
+        if (Result.Order == -1 && TC.isOwner()) {
+            Result.Order = 0;
+        }
+        Result.DerefNum = 0;
+        Result.HasPointerField |= TC.isPointer();
+    } else {
+        // Dereference the current pointer/owner
+        if (!Result.Type.isNull()) {
+            Result.Type = getPointeeType(Result.Type);
+        }
+        if (Result.Order >= 0) {
+            ++Result.Order;
+        }
+        ++Result.DerefNum;
+        Result.DerefsPointerField |= Result.HasPointerField;
+    }
+    return Result;
+}
+
+bool VariableTable::isPrefixOf(Id Ancestor, Id V) const
+{
+    // Equal paths from the same base are the same trie node, so walk up to the depth of Ancestor
+    const auto Depth = Entries[Ancestor].Path.size();
+    if (Entries[V].BaseId != Entries[Ancestor].BaseId || Entries[V].Path.size() < Depth) {
+        return false;
+    }
+    while (Entries[V].Path.size() > Depth) {
+        V = Entries[V].Parent;
+    }
+    return V == Ancestor;
+}
+
+void VariableTable::clear()
+{
+    Entries.clear();
+    Roots.clear();
+    Children.clear();
+}
+
+}
@@ -0,0 +1,144 @@
+#include "cppsafe/lifetime/WeakTopologicalOrder.h"
+
+#include <clang/Analysis/CFG.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace clang::lifetime {
+
+namespace {
+
+/// Bourdoncle's recursive algorithm, with an explicit stack of frames instead of recursion so that long chains
+/// of blocks do not overflow the stack. Elements are appended, so each list is built backwards and reversed
+/// once complete.
+class WTOBuilder {
+public:
+    explicit WTOBuilder(const CFG& Cfg)
+        : DFN(Cfg.getNumBlockIDs(), 0)
+    {
+    }
+
+    std::vector<WTOElement> build(const CFGBlock& Entry)
+    {
+        enter(Entry);
+        while (!Frames.empty()) {
+            auto& F = Frames.back();
+            if (F.Next == F.Block->succ_end()) {
+                leave();
+                continue;
+            }
+
+            const CFGBlock* Succ = *F.Next++;
+            if (!Succ) {
+                continue;
+            }
+            if (dfn(*Succ) == 0) {
+                enter(*Succ);
+            } else if (!F.InComponent) {
+                reach(F, dfn(*Succ));
+            }
+        }
+        std::reverse(Order.begin(), Order.end());
+        return std::move(Order);
+    }
+
+private:
+    static constexpr unsigned Done = std::numeric_limits<unsigned>::max();
+
+    /// A block whose successors are being visited
+    struct Frame {
+        const CFGBlock* Block;
+        CFGBlock::const_succ_iterator Next;
+        /// The depth-first number of the highest block on the stack reachable from Block
+        unsigned Head;
+        bool IsLoop = false;
+        /// Whether the successors are visited again as the body of the loop headed by Block, see leave()
+        bool InComponent = false;
+    };
+
+    unsigned& dfn(const CFGBlock& B) { return DFN[B.getBlockID()]; }
+
+    /// The list that finished elements are added to, the body of the innermost loop being ordered
+    std::vector<WTOElement>& partition() { return Loops.empty() ? Order : Loops.back().Body; }
+
+    void enter(const CFGBlock& B)
+    {
+        Stack.push_back(&B);
+        dfn(B) = ++Num;
+        Frames.push_back(Frame { &B, B.succ_begin(), dfn(B) });
+    }
+
+    static void reach(Frame& F, unsigned Min)
+    {
+        if (Min <= F.Head) {
+            F.Head = Min;
+            F.IsLoop = true;
+        }
+    }
+
+    /// Returns the head reachable from the finished top frame to the frame below.
+    void finish(unsigned Head)
+    {
+        Frames.pop_back();
+        if (!Frames.empty() && !Frames.back().InComponent) {
+            reach(Frames.back(), Head);
+        }
+    }
+
+    /// Finishes the top frame once all its successors were visited.
+    void leave()
+    {
+        auto& F = Frames.back();
+        const auto& B = *F.Block;
+        if (F.InComponent) {
+            auto Loop = std::move(Loops.back());
+            Loops.pop_back();
+            std::reverse(Loop.Body.begin(), Loop.Body.end());
+            partition().push_back(std::move(Loop));
+            finish(F.Head);
+            return;
+        }
+
+        if (F.Head != dfn(B)) {
+            finish(F.Head);
+            return;
+        }
+
+        dfn(B) = Done;
+        const auto* Top = Stack.pop_back_val();
+        if (!F.IsLoop) {
+            partition().push_back(WTOElement { &B });
+            finish(F.Head);
+            return;
+        }
+
+        // The blocks above B on the stack belong to the loop, they are ordered again within it
+        while (Top != &B) {
+            dfn(*Top) = 0;
+            Top = Stack.pop_back_val();
+        }
+        Loops.push_back(WTOElement { &B, true });
+        F.InComponent = true;
+        F.Next = B.succ_begin();
+    }
+
+    std::vector<unsigned> DFN;
+    llvm::SmallVector<const CFGBlock*, 32> Stack;
+    llvm::SmallVector<Frame, 32> Frames;
+    /// The loops being ordered, innermost last
+    std::vector<WTOElement> Loops;
+    std::vector<WTOElement> Order;
+    unsigned Num = 0;
+};
+
+} // namespace
+
+std::vector<WTOElement> computeWeakTopologicalOrder(const CFG& Cfg)
+{
+    return WTOBuilder(Cfg).build(Cfg.getEntry());
+}
+
+} // namespace clang::lifetime
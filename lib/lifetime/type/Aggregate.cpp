@@ -165,13 +165,13 @@ void handleAggregateCopy(const Expr* LHS, const Expr* RHS, PSBuilder& Builder)
     CPPSAFE_ASSERT(OtherPS.vars().size() <= 1);
 
     // if PSet(RHS) = {}, use it as a placeholder to derive members
-    const Variable Candidate(Builder.ignoreTransparentExprs(RHS));
-    const auto* Other = OtherPS.vars().empty() ? &Candidate : &*OtherPS.vars().begin();
+    const Variable Other
+        = OtherPS.vars().empty() ? Variable(Builder.ignoreTransparentExprs(RHS)) : *OtherPS.vars().begin();
     const auto* RD = LHS->getType()->getAsCXXRecordDecl();
     const Variable Base(LHS);
     expandAggregate(Base, RD,
-        [&Base, &Builder, Other, &OtherPS](const Variable& LhsSubVar, const SubVarPath& Path, TypeClassification TC) {
-            const Variable RhsSubVar(Other->chainFields(Path));
+        [&Base, &Builder, &Other, &OtherPS](const Variable& LhsSubVar, const SubVarPath& Path, TypeClassification TC) {
+            const Variable RhsSubVar(Other.chainFields(Path));
             if (!TC.isPointer()) {
                 return;
             }
@@ -0,0 +1,92 @@
+#include "AstFile.h"
+
+#include "cppsafe/AstConsumer.h"
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclBase.h>
+#include <clang/AST/DeclGroup.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/FileSystemOptions.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/HeaderSearchOptions.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+#include <memory>
+#include <vector>
+
+namespace cppsafe {
+
+std::string getAstPath(llvm::StringRef AstDir, llvm::StringRef Source)
+{
+    llvm::SmallString<256> Path(AstDir);
+    llvm::sys::path::append(Path, llvm::sys::path::filename(Source));
+    llvm::sys::path::replace_extension(Path, "ast");
+    return std::string(Path);
+}
+
+std::optional<int> analyzeAstFile(llvm::StringRef AstPath, llvm::StringRef Source, const CppsafeOptions& Options,
+    FunctionCache* FnCache, FunctionRegistry* Registry, clang::DiagnosticConsumer& Client)
+{
+    if (!llvm::sys::fs::exists(AstPath)) {
+        return std::nullopt;
+    }
+
+    // Loading fails if an input file changed since the AST was built, which is not worth a diagnostic
+    clang::IgnoringDiagConsumer IgnoreDiags;
+    auto Diags = clang::CompilerInstance::createDiagnostics(
+        new clang::DiagnosticOptions(), &IgnoreDiags, /*ShouldOwnClient=*/false);
+    const auto PCHContainerOps = std::make_shared<clang::PCHContainerOperations>();
+    auto AST = clang::ASTUnit::LoadFromASTFile(AstPath.str(), PCHContainerOps->getRawReader(),
+        clang::ASTUnit::LoadEverything, Diags, clang::FileSystemOptions(),
+        std::make_shared<clang::HeaderSearchOptions>());
+    if (!AST || Diags->hasErrorOccurred()) {
+        return std::nullopt;
+    }
+
+    // Several sources may share a file name, so the AST in the directory may belong to another one
+    if (!llvm::sys::fs::equivalent(AST->getOriginalSourceFileName(), Source)) {
+        return std::nullopt;
+    }
+
+    Diags->setClient(&Client, /*ShouldOwnClient=*/false);
+    auto& Ctx = AST->getASTContext();
+    auto& PP = AST->getPreprocessor();
+    Client.BeginSourceFile(Ctx.getLangOpts(), &PP);
+
+    {
+        AstConsumer Consumer(Options, FnCache, Registry);
+        Consumer.Initialize(Ctx);
+
+        // Initialize() attaches the AST reader as external Sema source, and calls Consumer.InitializeSema
+        clang::Sema S(PP, Ctx, Consumer, clang::TU_Complete);
+        S.Initialize();
+
+        // A loaded AST lists the decls of every file context, e.g. the functions of a namespace next to the
+        // namespace itself, which HandleTopLevelDecl already traverses
+        std::vector<clang::Decl*> Decls;
+        AST->visitLocalTopLevelDecls(&Decls, [](void* Context, const clang::Decl* D) {
+            if (D->getLexicalDeclContext()->isTranslationUnit()) {
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast): ASTConsumer takes mutable decls
+                static_cast<std::vector<clang::Decl*>*>(Context)->push_back(const_cast<clang::Decl*>(D));
+            }
+            return true;
+        });
+        for (auto* D : Decls) {
+            if (!Consumer.HandleTopLevelDecl(clang::DeclGroupRef(D))) {
+                break;
+            }
+        }
+        Consumer.HandleTranslationUnit(Ctx);
+    }
+
+    Client.EndSourceFile();
+    return Diags->hasErrorOccurred() ? 1 : 0;
+}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "cppsafe/FunctionCache.h"
+#include "cppsafe/FunctionRegistry.h"
+#include "cppsafe/Options.h"
+
+#include <clang/Basic/Diagnostic.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <optional>
+#include <string>
+
+namespace cppsafe {
+
+/// Path of the serialized AST of \p Source in \p AstDir, as written by `clang -emit-ast` run in
+/// \p AstDir, i.e. the file name of the source with the extension replaced by `.ast`.
+std::string getAstPath(llvm::StringRef AstDir, llvm::StringRef Source);
+
+/// Analyze the serialized AST of \p Source instead of parsing it. The declarations are deserialized
+/// on demand, and a Sema is created on top of them for the instantiations done by the analysis.
+///
+/// \returns the exit code of the TU, or std::nullopt if the AST is missing, was built from another
+///          source, or is stale (some input changed since it was built). The source must be parsed
+///          then.
+std::optional<int> analyzeAstFile(llvm::StringRef AstPath, llvm::StringRef Source, const CppsafeOptions& Options,
+    FunctionCache* FnCache, FunctionRegistry* Registry, clang::DiagnosticConsumer& Client);
+
+}
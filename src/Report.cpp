@@ -0,0 +1,203 @@
+#include "Report.h"
+
+#include <clang/Basic/DiagnosticIDs.h>
+#include <clang/Basic/SourceLocation.h>
+#include <clang/Basic/SourceManager.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <utility>
+
+namespace cppsafe {
+
+llvm::json::Value toJSON(const DiagRecord& R)
+{
+    return llvm::json::Object {
+        { "level", R.Level },
+        { "file", R.File },
+        { "line", R.Line },
+        { "column", R.Column },
+        { "message", R.Message },
+        { "notes", R.Notes },
+        { "lifetime", R.Lifetime },
+    };
+}
+
+llvm::json::Value toJSON(const TUReport& R)
+{
+    return llvm::json::Object {
+        { "file", R.File },
+        { "seconds", R.Seconds },
+        { "returnCode", R.ReturnCode },
+        { "diagnostics", R.Diags },
+    };
+}
+
+llvm::json::Value toJSON(const Report& R)
+{
+    return llvm::json::Object {
+        { "version", R.Version },
+        { "shard", R.Shard },
+        { "files", R.TUs },
+    };
+}
+
+bool fromJSON(const llvm::json::Value& V, DiagRecord& R, llvm::json::Path P)
+{
+    llvm::json::ObjectMapper O(V, P);
+    return O && O.map("level", R.Level) && O.map("file", R.File) && O.map("line", R.Line)
+        && O.map("column", R.Column) && O.map("message", R.Message) && O.map("notes", R.Notes)
+        && O.mapOptional("lifetime", R.Lifetime);
+}
+
+bool fromJSON(const llvm::json::Value& V, TUReport& R, llvm::json::Path P)
+{
+    llvm::json::ObjectMapper O(V, P);
+    return O && O.map("file", R.File) && O.map("seconds", R.Seconds) && O.map("returnCode", R.ReturnCode)
+        && O.map("diagnostics", R.Diags);
+}
+
+bool fromJSON(const llvm::json::Value& V, Report& R, llvm::json::Path P)
+{
+    llvm::json::ObjectMapper O(V, P);
+    return O && O.map("version", R.Version) && O.map("shard", R.Shard) && O.map("files", R.TUs);
+}
+
+llvm::Error writeReport(llvm::StringRef Path, const Report& R)
+{
+    return llvm::writeToOutput(Path, [&R](llvm::raw_ostream& OS) {
+        OS << llvm::formatv("{0:2}", toJSON(R)) << "\n";
+        return llvm::Error::success();
+    });
+}
+
+llvm::Expected<Report> readReport(llvm::StringRef Path)
+{
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+        return llvm::createFileError(Path, Buffer.getError());
+    }
+
+    auto R = llvm::json::parse<Report>((*Buffer)->getBuffer(), "report");
+    if (!R) {
+        return llvm::createFileError(Path, R.takeError());
+    }
+    return R;
+}
+
+DiagKey getDiagKey(const DiagRecord& D)
+{
+    DiagKey Key { { D.Level, D.File, D.Line, D.Column, D.Message } };
+    for (const auto& N : D.Notes) {
+        Key.emplace_back(N.Level, N.File, N.Line, N.Column, N.Message);
+    }
+    return Key;
+}
+
+bool isReportedOnce(const DiagRecord& D) { return D.Lifetime && D.Level == "warning"; }
+
+Report mergeReports(const std::vector<Report>& Reports)
+{
+    Report Merged;
+    for (const auto& R : Reports) {
+        if (Merged.Version.empty()) {
+            Merged.Version = R.Version;
+        }
+        Merged.TUs.insert(Merged.TUs.end(), R.TUs.begin(), R.TUs.end());
+    }
+
+    std::stable_sort(Merged.TUs.begin(), Merged.TUs.end(),
+        [](const TUReport& A, const TUReport& B) { return A.File < B.File; });
+
+    // The same TU may be analyzed by two shards if their source lists overlap
+    Merged.TUs.erase(std::unique(Merged.TUs.begin(), Merged.TUs.end(),
+                         [](const TUReport& A, const TUReport& B) { return A.File == B.File; }),
+        Merged.TUs.end());
+
+    std::set<DiagKey> Seen;
+    for (auto& TU : Merged.TUs) {
+        std::erase_if(
+            TU.Diags, [&Seen](const DiagRecord& D) { return isReportedOnce(D) && !Seen.insert(getDiagKey(D)).second; });
+    }
+
+    return Merged;
+}
+
+static void printDiag(const DiagRecord& D, llvm::raw_ostream& OS)
+{
+    if (!D.File.empty()) {
+        OS << D.File << ":" << D.Line << ":" << D.Column << ": ";
+    }
+    OS << D.Level << ": " << D.Message << "\n";
+}
+
+void printDiags(const TUReport& TU, llvm::raw_ostream& OS)
+{
+    for (const auto& D : TU.Diags) {
+        printDiag(D, OS);
+        for (const auto& N : D.Notes) {
+            printDiag(N, OS);
+        }
+    }
+}
+
+static const char* getLevelName(clang::DiagnosticsEngine::Level Level)
+{
+    switch (Level) {
+    case clang::DiagnosticsEngine::Ignored:
+        return "ignored";
+    case clang::DiagnosticsEngine::Note:
+        return "note";
+    case clang::DiagnosticsEngine::Remark:
+        return "remark";
+    case clang::DiagnosticsEngine::Warning:
+        return "warning";
+    case clang::DiagnosticsEngine::Error:
+        return "error";
+    case clang::DiagnosticsEngine::Fatal:
+        return "fatal error";
+    }
+    return "unknown";
+}
+
+void RecordingDiagConsumer::HandleDiagnostic(clang::DiagnosticsEngine::Level Level, const clang::Diagnostic& Info)
+{
+    DiagnosticConsumer::HandleDiagnostic(Level, Info);
+
+    const bool IsNote = Level == clang::DiagnosticsEngine::Note && !Records.empty();
+    if (Offsets != nullptr && !IsNote) {
+        Offsets->push_back(static_cast<unsigned>(Printed->size()));
+    }
+    Target.HandleDiagnostic(Level, Info);
+
+    DiagRecord R;
+    R.Level = getLevelName(Level);
+    // The lifetime analysis registers its diagnostics as custom ones
+    R.Lifetime = Info.getID() >= clang::diag::DIAG_UPPER_LIMIT;
+
+    llvm::SmallString<256> Message;
+    Info.FormatDiagnostic(Message);
+    R.Message = Message.str().str();
+
+    if (Info.hasSourceManager() && Info.getLocation().isValid()) {
+        const auto& SM = Info.getSourceManager();
+        const auto PLoc = SM.getPresumedLoc(SM.getExpansionLoc(Info.getLocation()));
+        if (PLoc.isValid()) {
+            R.File = PLoc.getFilename();
+            R.Line = static_cast<int>(PLoc.getLine());
+            R.Column = static_cast<int>(PLoc.getColumn());
+        }
+    }
+
+    if (IsNote) {
+        Records.back().Notes.push_back(std::move(R));
+    } else {
+        Records.push_back(std::move(R));
+    }
+}
+
+} // namespace cppsafe
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "cppsafe/util/type.h"
+
+#include <clang/Basic/Diagnostic.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace cppsafe {
+
+/// A diagnostic detached from its SourceManager, so that it can outlive the TU.
+struct DiagRecord {
+    std::string Level;
+    std::string File;
+    int Line = 0;
+    int Column = 0;
+    std::string Message;
+    std::vector<DiagRecord> Notes;
+    /// Reported by the lifetime analysis rather than by the compiler.
+    bool Lifetime = false;
+};
+
+/// Identity of a diagnostic across TUs, e.g. of a warning in a header included by several of them:
+/// the level, location and message of the diagnostic followed by those of its notes.
+using DiagKey = std::vector<std::tuple<std::string, std::string, int, int, std::string>>;
+
+DiagKey getDiagKey(const DiagRecord& D);
+
+/// Whether \p D is reported only by the first TU having it. Only lifetime warnings are, as a compiler error in a
+/// shared header may depend on the including TU.
+bool isReportedOnce(const DiagRecord& D);
+
+/// Result of analyzing a single TU.
+struct TUReport {
+    std::string File;
+    double Seconds = 0;
+    int ReturnCode = 0;
+    std::vector<DiagRecord> Diags;
+};
+
+/// Self-contained result of one run (or one shard of it), see `cppsafe merge`.
+struct Report {
+    std::string Version;
+    std::string Shard;
+    std::vector<TUReport> TUs;
+};
+
+llvm::json::Value toJSON(const DiagRecord& R);
+llvm::json::Value toJSON(const TUReport& R);
+llvm::json::Value toJSON(const Report& R);
+
+bool fromJSON(const llvm::json::Value& V, DiagRecord& R, llvm::json::Path P);
+bool fromJSON(const llvm::json::Value& V, TUReport& R, llvm::json::Path P);
+bool fromJSON(const llvm::json::Value& V, Report& R, llvm::json::Path P);
+
+llvm::Error writeReport(llvm::StringRef Path, const Report& R);
+
+llvm::Expected<Report> readReport(llvm::StringRef Path);
+
+/// Merge reports of several shards. TUs are sorted by file, and a lifetime warning reported by
+/// several TUs (e.g. in a shared header) with the same notes is kept only once.
+Report mergeReports(const std::vector<Report>& Reports);
+
+/// Print diagnostics in the usual `file:line:col: level: message` form.
+void printDiags(const TUReport& TU, llvm::raw_ostream& OS);
+
+/// Forwards diagnostics to another consumer and records them as DiagRecord.
+class RecordingDiagConsumer : public clang::DiagnosticConsumer {
+public:
+    /// \param Printed if non-null, the output \p Target prints to. The offset in it where each record starts is
+    ///        appended to \p Offsets, so that the printed diagnostics can be filtered by their records.
+    RecordingDiagConsumer(clang::DiagnosticConsumer& Target, std::vector<DiagRecord>& Records,
+        const std::string* Printed = nullptr, std::vector<unsigned>* Offsets = nullptr)
+        : Target(Target)
+        , Records(Records)
+        , Printed(Printed)
+        , Offsets(Offsets)
+    {
+    }
+
+    ~RecordingDiagConsumer() override = default;
+
+    DISALLOW_COPY_AND_MOVE(RecordingDiagConsumer);
+
+    void BeginSourceFile(const clang::LangOptions& LangOpts, const clang::Preprocessor* PP) override
+    {
+        Target.BeginSourceFile(LangOpts, PP);
+    }
+
+    void EndSourceFile() override { Target.EndSourceFile(); }
+
+    void finish() override { Target.finish(); }
+
+    void clear() override
+    {
+        DiagnosticConsumer::clear();
+        Target.clear();
+    }
+
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level Level, const clang::Diagnostic& Info) override;
+
+private:
+    clang::DiagnosticConsumer& Target;
+    std::vector<DiagRecord>& Records;
+    const std::string* Printed;
+    std::vector<unsigned>* Offsets;
+};
+
+}
@@ -0,0 +1,281 @@
+#include "ResultCache.h"
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Basic/TokenKinds.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/Token.h>
+#include <fmt/core.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/BLAKE3.h>
+#include <llvm/Support/CachePruning.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/WithColor.h>
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <utility>
+
+using clang::tooling::ClangTool;
+using clang::tooling::CommandLineArguments;
+
+namespace cppsafe {
+
+namespace {
+
+void hashInt(llvm::BLAKE3& Hasher, std::uint64_t V)
+{
+    std::array<std::uint8_t, sizeof(V)> Bytes {};
+    llvm::support::endian::write64le(Bytes.data(), V);
+    Hasher.update(Bytes);
+}
+
+void hashString(llvm::BLAKE3& Hasher, llvm::StringRef S)
+{
+    hashInt(Hasher, S.size());
+    Hasher.update(S);
+}
+
+/// Hashes the raw contents of every file the preprocessor enters, which covers the directives it consumes,
+/// e.g. `#pragma clang diagnostic`, that leave no tokens behind.
+class EnteredFilesHasher : public clang::PPCallbacks {
+public:
+    EnteredFilesHasher(const clang::SourceManager& SM, llvm::BLAKE3& Hasher)
+        : SM(SM)
+        , Hasher(Hasher)
+    {
+    }
+
+    void FileChanged(clang::SourceLocation Loc, FileChangeReason Reason, clang::SrcMgr::CharacteristicKind /*FileType*/,
+        clang::FileID /*PrevFID*/) override
+    {
+        if (Reason != EnterFile) {
+            return;
+        }
+        if (auto Data = SM.getBufferDataOrNone(SM.getFileID(Loc))) {
+            hashString(Hasher, SM.getBufferName(Loc));
+            hashString(Hasher, *Data);
+        }
+    }
+
+private:
+    const clang::SourceManager& SM;
+    llvm::BLAKE3& Hasher;
+};
+
+class PreprocessedHashAction : public clang::PreprocessorFrontendAction {
+public:
+    explicit PreprocessedHashAction(llvm::BLAKE3& Hasher)
+        : Hasher(Hasher)
+    {
+    }
+
+protected:
+    void ExecuteAction() override
+    {
+        auto& PP = getCompilerInstance().getPreprocessor();
+        const auto& SM = PP.getSourceManager();
+        PP.addPPCallbacks(std::make_unique<EnteredFilesHasher>(SM, Hasher));
+        PP.EnterMainSourceFile();
+
+        clang::FileID LastFile;
+        llvm::SmallString<64> Buffer;
+        clang::Token Tok;
+        for (PP.Lex(Tok); Tok.isNot(clang::tok::eof); PP.Lex(Tok)) {
+            const auto Loc = SM.getExpansionLoc(Tok.getLocation());
+            const auto [File, Offset] = SM.getDecomposedLoc(Loc);
+            if (File != LastFile) {
+                LastFile = File;
+                hashString(Hasher, SM.getBufferName(Loc));
+            }
+            hashInt(Hasher, Offset);
+            hashString(Hasher, PP.getSpelling(Tok, Buffer));
+        }
+    }
+
+private:
+    llvm::BLAKE3& Hasher;
+};
+
+class PreprocessedHashActionFactory : public clang::tooling::FrontendActionFactory {
+public:
+    explicit PreprocessedHashActionFactory(llvm::BLAKE3& Hasher)
+        : Hasher(Hasher)
+    {
+    }
+
+    std::unique_ptr<clang::FrontendAction> create() override
+    {
+        return std::make_unique<PreprocessedHashAction>(Hasher);
+    }
+
+private:
+    llvm::BLAKE3& Hasher;
+};
+
+}
+
+std::optional<ResultKey> computeResultKey(ClangTool& Tool, const CppsafeOptions& Options, bool ShowColors)
+{
+    llvm::BLAKE3 CommandHasher;
+    hashString(CommandHasher, CPPSAFE_VERSION);
+    for (const bool Flag : { Options.LifetimeMove, Options.LifetimeNull, Options.LifetimeCallNull,
+             Options.LifetimePost, Options.LifetimeDisabled, Options.LifetimeGlobal, Options.LifetimeOutput,
+             ShowColors }) {
+        hashInt(CommandHasher, Flag);
+    }
+    hashInt(CommandHasher, Options.FunctionTimeBudget);
+    hashInt(CommandHasher, Options.MaxBlockVisits);
+    hashString(CommandHasher, Options.HeaderFilter);
+    hashString(CommandHasher, Options.ExcludePath);
+
+    // Runs last, so it sees the arguments after all adjusters of the caller
+    Tool.appendArgumentsAdjuster([&CommandHasher](const CommandLineArguments& Args, llvm::StringRef) {
+        hashInt(CommandHasher, Args.size());
+        for (const auto& Arg : Args) {
+            hashString(CommandHasher, Arg);
+        }
+        return Args;
+    });
+
+    clang::IgnoringDiagConsumer IgnoreDiags;
+    Tool.setDiagnosticConsumer(&IgnoreDiags);
+
+    llvm::BLAKE3 TokenHasher;
+    PreprocessedHashActionFactory Factory(TokenHasher);
+    if (Tool.run(&Factory) != 0) {
+        return std::nullopt;
+    }
+
+    ResultKey Key;
+    Key.Command = llvm::toHex(CommandHasher.final(), /*LowerCase=*/true);
+
+    llvm::BLAKE3 ContentHasher;
+    hashString(ContentHasher, Key.Command);
+    hashString(ContentHasher, llvm::toHex(TokenHasher.final(), /*LowerCase=*/true));
+
+    // Not part of Command, the diagnostics of a function do not depend on which functions are analyzed
+    hashInt(ContentHasher, Options.Changed != nullptr);
+    if (Options.Changed) {
+        for (const auto& [Name, Ranges] : Options.Changed->getFiles()) {
+            hashString(ContentHasher, Name);
+            hashInt(ContentHasher, Ranges.size());
+            for (const auto& R : Ranges) {
+                hashInt(ContentHasher, R.First);
+                hashInt(ContentHasher, R.Last);
+            }
+        }
+    }
+    Key.Content = llvm::toHex(ContentHasher.final(), /*LowerCase=*/true);
+
+    return Key;
+}
+
+ResultCache::ResultCache(std::string Dir, std::uint64_t MaxBytes)
+    : Dir(std::move(Dir))
+    , MaxBytes(MaxBytes)
+{
+    if (auto EC = llvm::sys::fs::create_directories(this->Dir)) {
+        llvm::WithColor::warning() << "cannot create cache directory " << this->Dir << ": " << EC.message() << "\n";
+    }
+}
+
+std::string ResultCache::getEntryPath(llvm::StringRef Key) const
+{
+    // pruneCache only considers files with this prefix
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+}
+
+std::string ResultCache::getFunctionCachePath(llvm::StringRef CommandKey) const
+{
+    return getEntryPath("functions-" + CommandKey.str());
+}
+
+std::optional<ResultCache::Entry> ResultCache::lookup(llvm::StringRef Key)
+{
+    const auto Path = getEntryPath(Key);
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+        ++Misses;
+        return std::nullopt;
+    }
+
+    Entry E;
+    auto Parsed = llvm::json::parse(Buffer.get()->getBuffer());
+    if (!Parsed) {
+        llvm::consumeError(Parsed.takeError());
+        ++Misses;
+        return std::nullopt;
+    }
+    llvm::json::Path::Root Root;
+    llvm::json::ObjectMapper O(*Parsed, Root);
+    if (!O || !O.map("output", E.Output) || !O.map("offsets", E.DiagOffsets) || !O.map("result", E.TU)) {
+        ++Misses;
+        return std::nullopt;
+    }
+
+    // Access time is not reliably updated by the OS, but it decides which entries are evicted
+    if (auto FD = llvm::sys::fs::openNativeFileForReadWrite(
+            Path, llvm::sys::fs::CD_OpenExisting, llvm::sys::fs::OF_None)) {
+        (void)llvm::sys::fs::setLastAccessAndModificationTime(*FD, std::chrono::system_clock::now());
+        llvm::sys::fs::closeFile(*FD);
+    } else {
+        llvm::consumeError(FD.takeError());
+    }
+
+    ++Hits;
+    return E;
+}
+
+void ResultCache::store(llvm::StringRef Key, const Entry& E)
+{
+    // writeToOutput writes to a temporary file first, concurrent runs never see a partial entry
+    auto Err = llvm::writeToOutput(getEntryPath(Key), [&E](llvm::raw_ostream& OS) {
+        OS << llvm::json::Value(llvm::json::Object {
+            { "output", E.Output },
+            { "offsets", E.DiagOffsets },
+            { "result", E.TU },
+        });
+        return llvm::Error::success();
+    });
+    if (Err) {
+        llvm::WithColor::warning() << "cannot write cache entry " << Key << ": " << llvm::toString(std::move(Err))
+                                   << "\n";
+    }
+}
+
+void ResultCache::prune() const
+{
+    llvm::CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.Expiration = std::chrono::seconds(0);
+    Policy.MaxSizePercentageOfAvailableSpace = 0;
+    Policy.MaxSizeBytes = MaxBytes;
+    llvm::pruneCache(Dir, Policy);
+}
+
+void ResultCache::printStats(llvm::raw_ostream& OS) const
+{
+    const unsigned Total = Hits + Misses + Uncacheable;
+    OS << fmt::format("result cache: {} hits, {} misses, {} uncacheable ({:.1f}% hit rate)\n", Hits.load(),
+        Misses.load(), Uncacheable.load(), Total == 0 ? 0.0 : 100.0 * Hits / Total);
+    if (Misses != 0) {
+        OS << fmt::format("function cache: {} functions reused, {} analyzed\n", ReusedFunctions.load(),
+            AnalyzedFunctions.load());
+    }
+}
+
+}
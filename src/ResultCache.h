@@ -0,0 +1,94 @@
+#pragma once
+
+#include "cppsafe/Options.h"
+#include "cppsafe/util/type.h"
+
+#include "Report.h"
+
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+struct ResultKey {
+    /// Covers the preprocessed token stream together with the token positions (so that a hit also
+    /// reproduces the diagnostic locations), the raw contents of every included file (so that
+    /// directives like `#pragma clang diagnostic` count as well), the changed lines of `--diff`,
+    /// and everything covered by Command.
+    std::string Content;
+    /// Covers the final compiler arguments, the cppsafe version and the options only, so it stays
+    /// the same while the sources are edited.
+    std::string Command;
+};
+
+/// Compute the cache key of the single source of \p Tool, whose arguments adjusters must already
+/// be set up.
+///
+/// Returns std::nullopt if the source cannot be preprocessed.
+/// \throws DetectSystemIncludesError
+std::optional<ResultKey> computeResultKey(
+    clang::tooling::ClangTool& Tool, const CppsafeOptions& Options, bool ShowColors);
+
+/// Content-addressed store of per-TU results in a local directory, see `--cache-dir`.
+///
+/// Entries are written atomically, so concurrent runs may share a directory. A hit refreshes the
+/// access time of its entry, which `prune` uses to evict the least recently used entries.
+class ResultCache {
+public:
+    struct Entry {
+        /// Diagnostics as printed by the analysis run
+        std::string Output;
+        /// Where each diagnostic of TU starts in Output
+        std::vector<unsigned> DiagOffsets;
+        TUReport TU;
+    };
+
+    ResultCache(std::string Dir, std::uint64_t MaxBytes);
+
+    ~ResultCache() = default;
+
+    DISALLOW_COPY_AND_MOVE(ResultCache);
+
+    std::optional<Entry> lookup(llvm::StringRef Key);
+
+    void store(llvm::StringRef Key, const Entry& E);
+
+    /// The TU has no key, e.g. because it cannot be preprocessed.
+    void noteUncacheable() { ++Uncacheable; }
+
+    /// Path of the FunctionCache of a TU that missed, see ResultKey::Command.
+    std::string getFunctionCachePath(llvm::StringRef CommandKey) const;
+
+    void noteFunctions(unsigned FunctionHits, unsigned FunctionMisses)
+    {
+        ReusedFunctions += FunctionHits;
+        AnalyzedFunctions += FunctionMisses;
+    }
+
+    /// Evict least recently used entries until the directory fits into the size limit.
+    void prune() const;
+
+    void printStats(llvm::raw_ostream& OS) const;
+
+private:
+    std::string getEntryPath(llvm::StringRef Key) const;
+
+private:
+    std::string Dir;
+    std::uint64_t MaxBytes;
+
+    std::atomic<unsigned> Hits = 0;
+    std::atomic<unsigned> Misses = 0;
+    std::atomic<unsigned> Uncacheable = 0;
+    std::atomic<unsigned> ReusedFunctions = 0;
+    std::atomic<unsigned> AnalyzedFunctions = 0;
+};
+
+}
@@ -0,0 +1,304 @@
+#include "Server.h"
+
+#include "cppsafe/AstConsumer.h"
+
+#include "SystemIncludes.h"
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclGroup.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <system_error>
+#include <utility>
+
+using namespace clang;
+using namespace clang::tooling;
+
+namespace cppsafe {
+
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): only its address is used
+int StaticSymbol;
+
+// JSON-RPC 2.0 error codes
+constexpr int ParseError = -32700;
+constexpr int InvalidRequest = -32600;
+constexpr int MethodNotFound = -32601;
+constexpr int InvalidParams = -32602;
+constexpr int InternalError = -32603;
+
+llvm::Error makeError(std::errc Code, const llvm::Twine& Message)
+{
+    return llvm::createStringError(std::make_error_code(Code), Message);
+}
+
+llvm::json::Value makeErrorReply(llvm::json::Value Id, int Code, std::string Message)
+{
+    return llvm::json::Object {
+        { "jsonrpc", "2.0" },
+        { "id", std::move(Id) },
+        { "error", llvm::json::Object { { "code", Code }, { "message", std::move(Message) } } },
+    };
+}
+
+llvm::json::Value makeErrorReply(llvm::json::Value Id, llvm::Error Err)
+{
+    int Code = InternalError;
+    std::string Message;
+    llvm::handleAllErrors(std::move(Err), [&](const llvm::ErrorInfoBase& E) {
+        const auto EC = E.convertToErrorCode();
+        if (EC == std::errc::invalid_argument) {
+            Code = InvalidParams;
+        } else if (EC == std::errc::function_not_supported) {
+            Code = MethodNotFound;
+        }
+        Message = E.message();
+    });
+    return makeErrorReply(std::move(Id), Code, std::move(Message));
+}
+
+}
+
+/// Declarations are in the order of destruction dependencies: the ASTUnit reports to the recorder.
+struct Server::FileState {
+    FileState()
+        : Recorder(Ignore, Records)
+    {
+    }
+
+    ~FileState() = default;
+
+    DISALLOW_COPY_AND_MOVE(FileState);
+
+    // NOLINTBEGIN(cppcoreguidelines-non-private-member-variables-in-classes)
+    IgnoringDiagConsumer Ignore;
+    std::vector<DiagRecord> Records;
+    RecordingDiagConsumer Recorder;
+    FunctionCache FnCache { "" };
+    llvm::IntrusiveRefCntPtr<DiagnosticsEngine> Diags;
+    std::unique_ptr<ASTUnit> AST;
+    // NOLINTEND(cppcoreguidelines-non-private-member-variables-in-classes)
+};
+
+Server::Server(const CompilationDatabase* Compilations, ArgumentsAdjuster Adjuster, CppsafeOptions Options)
+    : Compilations(Compilations)
+    , Adjuster(combineAdjusters(
+          combineAdjusters(combineAdjusters(getClangStripOutputAdjuster(), getClangSyntaxOnlyAdjuster()),
+              getClangStripDependencyFileAdjuster()),
+          std::move(Adjuster)))
+    , Options(std::move(Options))
+    , ResourceDir(CompilerInvocation::GetResourcesPath("cppsafe", &StaticSymbol))
+    , PCHOps(std::make_shared<PCHContainerOperations>())
+{
+}
+
+Server::~Server() = default;
+
+int Server::run(std::istream& In, llvm::raw_ostream& Out)
+{
+    std::string Line;
+    while (!ShuttingDown && std::getline(In, Line)) {
+        if (llvm::StringRef(Line).trim().empty()) {
+            continue;
+        }
+        if (auto Reply = handle(Line)) {
+            Out << *Reply << "\n";
+            Out.flush();
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+std::optional<llvm::json::Value> Server::handle(llvm::StringRef Line)
+{
+    auto Message = llvm::json::parse(Line);
+    if (!Message) {
+        return makeErrorReply(nullptr, ParseError, llvm::toString(Message.takeError()));
+    }
+
+    const auto* Request = Message->getAsObject();
+    if (Request == nullptr) {
+        return makeErrorReply(nullptr, InvalidRequest, "request must be an object");
+    }
+
+    // Requests without id are notifications, which get no reply
+    const auto* Id = Request->get("id");
+    const auto Method = Request->getString("method");
+    if (!Method) {
+        return makeErrorReply(Id ? *Id : llvm::json::Value(nullptr), InvalidRequest, "missing method");
+    }
+
+    const auto* ParamsPtr = Request->get("params");
+    const llvm::json::Value Params = ParamsPtr ? *ParamsPtr : llvm::json::Value(llvm::json::Object {});
+
+    llvm::Expected<llvm::json::Value> Result = nullptr;
+    if (*Method == "check") {
+        Result = check(Params);
+    } else if (*Method == "invalidate") {
+        Result = invalidate(Params);
+    } else if (*Method == "shutdown") {
+        ShuttingDown = true;
+    } else {
+        Result = makeError(std::errc::function_not_supported, llvm::Twine("unknown method ") + *Method);
+    }
+
+    if (Id == nullptr) {
+        llvm::consumeError(Result.takeError());
+        return std::nullopt;
+    }
+    if (!Result) {
+        return makeErrorReply(*Id, Result.takeError());
+    }
+    return llvm::json::Object {
+        { "jsonrpc", "2.0" },
+        { "id", *Id },
+        { "result", std::move(*Result) },
+    };
+}
+
+llvm::Expected<llvm::json::Value> Server::check(const llvm::json::Value& Params)
+{
+    std::string File;
+    std::optional<std::string> Contents;
+    llvm::json::Path::Root Root;
+    llvm::json::ObjectMapper O(Params, Root);
+    if (!O || !O.map("file", File) || !O.mapOptional("contents", Contents)) {
+        return makeError(std::errc::invalid_argument, "check expects {file, contents?}");
+    }
+
+    const auto Start = std::chrono::steady_clock::now();
+    File = getAbsolutePath(File);
+    auto State = getFileState(File, std::move(Contents));
+    if (!State) {
+        return State.takeError();
+    }
+
+    auto& AST = *(*State)->AST;
+    auto& FnCache = (*State)->FnCache;
+    const auto Hits = FnCache.getHits();
+    const auto Misses = FnCache.getMisses();
+    {
+        // A reparse creates a new ASTContext, InitializeSema drops the caches keyed by the previous one
+        AstConsumer Consumer(Options, &FnCache);
+        Consumer.Initialize(AST.getASTContext());
+        Consumer.InitializeSema(AST.getSema());
+        for (auto It = AST.top_level_begin(); It != AST.top_level_end(); ++It) {
+            if (!Consumer.HandleTopLevelDecl(DeclGroupRef(*It))) {
+                break;
+            }
+        }
+        Consumer.ForgetSema();
+    }
+    FnCache.save();
+
+    return llvm::json::Object {
+        { "file", File },
+        { "diagnostics", (*State)->Records },
+        { "seconds", std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count() },
+        { "reusedFunctions", FnCache.getHits() - Hits },
+        { "analyzedFunctions", FnCache.getMisses() - Misses },
+    };
+}
+
+llvm::Expected<llvm::json::Value> Server::invalidate(const llvm::json::Value& Params)
+{
+    std::optional<std::string> File;
+    llvm::json::Path::Root Root;
+    llvm::json::ObjectMapper O(Params, Root);
+    if (!O || !O.mapOptional("file", File)) {
+        return makeError(std::errc::invalid_argument, "invalidate expects {file?}");
+    }
+
+    if (File) {
+        Files.erase(getAbsolutePath(*File));
+    } else {
+        Files.clear();
+    }
+    return nullptr;
+}
+
+llvm::Expected<Server::FileState*> Server::getFileState(const std::string& File, std::optional<std::string> Contents)
+{
+    // Owned by the ASTUnit once passed to it, like in libclang
+    std::vector<ASTUnit::RemappedFile> Remapped;
+    if (Contents) {
+        Remapped.emplace_back(File, llvm::MemoryBuffer::getMemBufferCopy(*Contents, File).release());
+    }
+
+    if (auto It = Files.find(File); It != Files.end()) {
+        auto& State = *It->second;
+        State.Records.clear();
+
+        // The preamble is reused unless the leading includes or the headers changed
+        if (!State.AST->Reparse(PCHOps, Remapped)) {
+            return &State;
+        }
+        Files.erase(It);
+        return makeError(std::errc::io_error, "cannot parse " + File);
+    }
+
+    std::unique_ptr<CompilationDatabase> Detected;
+    if (Compilations == nullptr) {
+        std::string Error;
+        Detected = CompilationDatabase::autoDetectFromSource(File, Error);
+        if (!Detected) {
+            return makeError(std::errc::invalid_argument, Error);
+        }
+    }
+
+    const auto Commands = (Detected ? *Detected : *Compilations).getCompileCommands(File);
+    if (Commands.empty()) {
+        return makeError(std::errc::invalid_argument, "no compile command for " + File);
+    }
+    const auto& Command = Commands.front();
+
+    CommandLineArguments Args;
+    try {
+        Args = Adjuster(Command.CommandLine, File);
+    } catch (const DetectSystemIncludesError& E) {
+        return makeError(std::errc::io_error, llvm::Twine("cannot find standard includes: ") + E.what());
+    }
+    std::vector<const char*> Argv;
+    Argv.reserve(Args.size());
+    for (const auto& Arg : Args) {
+        Argv.push_back(Arg.c_str());
+    }
+
+    auto FS = llvm::vfs::createPhysicalFileSystem();
+    if (const auto EC = FS->setCurrentWorkingDirectory(Command.Directory)) {
+        return makeError(std::errc::io_error, "cannot enter " + Command.Directory + ": " + EC.message());
+    }
+
+    auto State = std::make_unique<FileState>();
+    State->Diags = CompilerInstance::createDiagnostics(
+        new DiagnosticOptions(), &State->Recorder, /*ShouldOwnClient=*/false);
+    State->AST = ASTUnit::LoadFromCommandLine(Argv.data(), Argv.data() + Argv.size(), PCHOps, State->Diags,
+        ResourceDir, /*StorePreamblesInMemory=*/true, /*PreambleStoragePath=*/"", /*OnlyLocalDecls=*/false,
+        CaptureDiagsKind::None, Remapped, /*RemappedFilesKeepOriginalName=*/true,
+        /*PrecompilePreambleAfterNParses=*/1, TU_Complete, /*CacheCodeCompletionResults=*/false,
+        /*IncludeBriefCommentsInCodeCompletion=*/false, /*AllowPCHWithCompilerErrors=*/false,
+        SkipFunctionBodiesScope::None, /*SingleFileParse=*/false, /*UserFilesAreVolatile=*/true,
+        /*ForSerialization=*/false, /*RetainExcludedConditionalBlocks=*/false, /*ModuleFormat=*/std::nullopt,
+        /*ErrAST=*/nullptr, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>(FS.release()));
+    if (!State->AST) {
+        return makeError(std::errc::io_error, "cannot parse " + File);
+    }
+
+    auto* Result = State.get();
+    Files[File] = std::move(State);
+    return Result;
+}
+
+}
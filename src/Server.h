@@ -0,0 +1,75 @@
+#pragma once
+
+#include "cppsafe/FunctionCache.h"
+#include "cppsafe/Options.h"
+#include "cppsafe/util/type.h"
+
+#include "Report.h"
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+/// Long-running analysis of `--serve`, for editors and pre-commit hooks.
+///
+/// Speaks JSON-RPC 2.0 with one message per line over the given streams. Methods:
+/// - `check` {"file", "contents"?}: analyze the file, with its unsaved contents if given, and reply
+///   {"file", "diagnostics", "seconds", "reusedFunctions", "analyzedFunctions"}
+/// - `invalidate` {"file"?}: drop the state of the file, or of all files
+/// - `shutdown`: reply null and stop serving
+///
+/// Every checked file keeps its ASTUnit, so a re-check only reparses the main file on top of the
+/// precompiled preamble, and its FunctionCache, so only the functions whose fingerprint changed
+/// since the last check are analyzed again.
+class Server {
+public:
+    /// \param Compilations if null, the compilation database of a file is looked up in its parent directories
+    /// \param Adjuster applied to the compile command of a file, after the adjusters of ClangTool
+    Server(const clang::tooling::CompilationDatabase* Compilations, clang::tooling::ArgumentsAdjuster Adjuster,
+        CppsafeOptions Options);
+
+    ~Server();
+
+    DISALLOW_COPY_AND_MOVE(Server);
+
+    /// Serve requests until `shutdown` or the end of \p In.
+    int run(std::istream& In, llvm::raw_ostream& Out);
+
+private:
+    struct FileState;
+
+    std::optional<llvm::json::Value> handle(llvm::StringRef Line);
+
+    llvm::Expected<llvm::json::Value> check(const llvm::json::Value& Params);
+
+    llvm::Expected<llvm::json::Value> invalidate(const llvm::json::Value& Params);
+
+    llvm::Expected<FileState*> getFileState(const std::string& File, std::optional<std::string> Contents);
+
+private:
+    const clang::tooling::CompilationDatabase* Compilations;
+    clang::tooling::ArgumentsAdjuster Adjuster;
+    CppsafeOptions Options;
+    std::string ResourceDir;
+    std::shared_ptr<clang::PCHContainerOperations> PCHOps;
+
+    llvm::StringMap<std::unique_ptr<FileState>> Files;
+    bool ShuttingDown = false;
+};
+
+}
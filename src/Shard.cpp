@@ -0,0 +1,73 @@
+#include "Shard.h"
+
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <utility>
+
+namespace cppsafe {
+
+llvm::Expected<ShardSpec> parseShardSpec(llvm::StringRef Spec)
+{
+    auto [IndexStr, CountStr] = Spec.split('/');
+
+    ShardSpec Shard;
+    if (IndexStr.getAsInteger(10, Shard.Index) || CountStr.getAsInteger(10, Shard.Count) || Shard.Count == 0
+        || Shard.Index >= Shard.Count) {
+        return llvm::createStringError(
+            llvm::inconvertibleErrorCode(), "invalid shard '%s', expect i/n with 0 <= i < n", Spec.str().c_str());
+    }
+    return Shard;
+}
+
+std::vector<std::string> selectShard(
+    const std::vector<std::string>& Sources, const ShardSpec& Shard, const llvm::StringMap<double>& Costs)
+{
+    std::vector<std::string> Selected;
+    if (Costs.empty()) {
+        for (const auto& S : Sources) {
+            if (llvm::xxHash64(S) % Shard.Count == Shard.Index) {
+                Selected.push_back(S);
+            }
+        }
+        return Selected;
+    }
+
+    double Known = 0;
+    std::size_t NumKnown = 0;
+    for (const auto& S : Sources) {
+        if (auto It = Costs.find(S); It != Costs.end()) {
+            Known += It->second;
+            ++NumKnown;
+        }
+    }
+    const double DefaultCost = NumKnown ? Known / static_cast<double>(NumKnown) : 1.0;
+
+    std::vector<std::pair<double, std::size_t>> Order;
+    Order.reserve(Sources.size());
+    for (std::size_t I = 0; I < Sources.size(); ++I) {
+        const auto It = Costs.find(Sources[I]);
+        Order.emplace_back(It != Costs.end() ? It->second : DefaultCost, I);
+    }
+    // Ties are broken by path, so that the partition does not depend on the order of the source list
+    std::sort(Order.begin(), Order.end(), [&Sources](const auto& A, const auto& B) {
+        if (A.first != B.first) {
+            return A.first > B.first;
+        }
+        return Sources[A.second] < Sources[B.second];
+    });
+
+    std::vector<double> Loads(Shard.Count, 0.0);
+    for (const auto& [Cost, I] : Order) {
+        const auto Target = static_cast<unsigned>(std::min_element(Loads.begin(), Loads.end()) - Loads.begin());
+        Loads[Target] += Cost;
+        if (Target == Shard.Index) {
+            Selected.push_back(Sources[I]);
+        }
+    }
+    return Selected;
+}
+
+} // namespace cppsafe
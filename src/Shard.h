@@ -0,0 +1,29 @@
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+struct ShardSpec {
+    unsigned Index = 0;
+    unsigned Count = 1;
+};
+
+/// Parse `i/n`, where 0 <= i < n.
+llvm::Expected<ShardSpec> parseShardSpec(llvm::StringRef Spec);
+
+/// Select the sources of a shard. The partition only depends on the source list and the costs,
+/// so every shard of a run computes the same partition independently.
+///
+/// Without costs, a source goes to the shard given by a stable hash of its path. With costs (e.g.
+/// seconds per file of a previous run), sources are assigned greedily from the most expensive one
+/// to the least loaded shard. Sources without a known cost are assumed to have the average cost.
+std::vector<std::string> selectShard(
+    const std::vector<std::string>& Sources, const ShardSpec& Shard, const llvm::StringMap<double>& Costs);
+
+}
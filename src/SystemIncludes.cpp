@@ -0,0 +1,308 @@
+#include "SystemIncludes.h"
+
+#include <cpp-subprocess/subprocess.hpp>
+#include <fmt/core.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/iterator_range.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <utility>
+
+using clang::tooling::CommandLineArguments;
+using llvm::StringRef;
+
+namespace cppsafe {
+
+namespace {
+
+// Flags whose value is the next argument
+constexpr auto SeparateFlags = std::to_array<StringRef>({
+    "-target",
+    "--target",
+    "--sysroot",
+    "-isysroot",
+    "--gcc-toolchain",
+});
+
+// Flags whose value is attached
+constexpr auto JoinedFlags = std::to_array<StringRef>({
+    "--target=",
+    "--sysroot=",
+    "-isysroot",
+    "--gcc-toolchain=",
+    "--gcc-install-dir=",
+    "-stdlib=",
+});
+
+constexpr auto ExactFlags = std::to_array<StringRef>({
+    "-m32",
+    "-m64",
+    "-mx32",
+    "-nostdinc++",
+});
+
+// Flags of the above that other compilers, e.g. gcc, reject, matched as prefixes
+constexpr auto ClangOnlyFlags = std::to_array<StringRef>({
+    "-target",
+    "--target",
+    "-isysroot",
+    "--gcc-toolchain",
+    "--gcc-install-dir=",
+    "-stdlib=",
+});
+
+constexpr auto NoSystemIncludesFlags = std::to_array<StringRef>({
+    "-nostdinc",
+    "-nostdlibinc",
+    "--no-standard-includes",
+});
+
+/// Collect the flags of a compile command that change the system include directories.
+std::vector<std::string> getSystemIncludeFlags(const CommandLineArguments& Args)
+{
+    std::vector<std::string> Flags;
+    for (auto It = Args.begin(); It != Args.end(); ++It) {
+        const StringRef Arg = *It;
+        if (llvm::is_contained(SeparateFlags, Arg)) {
+            if (std::next(It) != Args.end()) {
+                Flags.push_back(Arg.str());
+                Flags.push_back(*++It);
+            }
+            continue;
+        }
+        if (llvm::is_contained(ExactFlags, Arg)
+            || llvm::any_of(JoinedFlags, [Arg](StringRef F) { return Arg.starts_with(F); })) {
+            Flags.push_back(Arg.str());
+        }
+    }
+    return Flags;
+}
+
+/// Drop the flags that only clang accepts, with their values.
+std::vector<std::string> withoutClangOnlyFlags(const std::vector<std::string>& Flags)
+{
+    std::vector<std::string> Result;
+    for (auto It = Flags.begin(); It != Flags.end(); ++It) {
+        const StringRef Flag = *It;
+        const bool Separate = llvm::is_contained(SeparateFlags, Flag);
+        if (llvm::any_of(ClangOnlyFlags, [Flag](StringRef F) { return Flag.starts_with(F); })) {
+            if (Separate) {
+                ++It;
+            }
+            continue;
+        }
+
+        Result.push_back(*It);
+        if (Separate) {
+            Result.push_back(*++It);
+        }
+    }
+    return Result;
+}
+
+std::string getCxxStamp(StringRef Cxx)
+{
+    // CXX may contain a launcher like `ccache c++`, stamp the first program only
+    const auto Program = llvm::sys::findProgramByName(Cxx.split(' ').first);
+    if (!Program) {
+        return {};
+    }
+
+    llvm::sys::fs::file_status Status;
+    if (llvm::sys::fs::status(*Program, Status)) {
+        return {};
+    }
+
+    return fmt::format("{}@{}", *Program, Status.getLastModificationTime().time_since_epoch().count());
+}
+
+} // namespace
+
+SystemIncludesDetector::SystemIncludesDetector(std::string Cxx, std::string CacheFile)
+    : Cxx(std::move(Cxx))
+    , CacheFile(std::move(CacheFile))
+{
+    if (!this->CacheFile.empty()) {
+        CxxStamp = getCxxStamp(this->Cxx);
+    }
+}
+
+CommandLineArguments SystemIncludesDetector::adjust(CommandLineArguments Args)
+{
+    if (llvm::any_of(Args, [](const std::string& A) { return llvm::is_contained(NoSystemIncludesFlags, A); })) {
+        return Args;
+    }
+
+    for (const auto& D : detect(getSystemIncludeFlags(Args))) {
+        Args.push_back("-idirafter");
+        Args.push_back(D);
+    }
+    return Args;
+}
+
+const std::vector<std::string>& SystemIncludesDetector::detect(const std::vector<std::string>& Flags)
+{
+    // Hold the lock while probing, so that concurrent TUs with the same key wait for a single probe
+    const std::lock_guard Lock(Mutex);
+
+    if (!CacheFileLoaded) {
+        CacheFileLoaded = true;
+        loadCacheFile();
+    }
+
+    auto Key = makeKey(Flags);
+    auto It = Cache.find(Key);
+    if (It != Cache.end()) {
+        return It->second;
+    }
+
+    // Other compilers reject the flags of clang, so they are probed without them
+    auto ProbeFlags = withoutClangOnlyFlags(Flags);
+    if (ProbeFlags.size() != Flags.size() && isClang()) {
+        ProbeFlags = Flags;
+    }
+
+    It = Cache.emplace(std::move(Key), probe(ProbeFlags)).first;
+    saveCacheFile();
+    return It->second;
+}
+
+std::string SystemIncludesDetector::makeKey(const std::vector<std::string>& Flags) const
+{
+    return fmt::format("{}|{}|{}", Cxx, CxxStamp, llvm::join(Flags, " "));
+}
+
+std::vector<std::string> SystemIncludesDetector::getCommand(const std::vector<std::string>& Args) const
+{
+    // CXX may contain a launcher like `ccache c++`
+    llvm::SmallVector<StringRef, 2> Words;
+    llvm::SplitString(Cxx, Words);
+
+    std::vector<std::string> Command(Words.begin(), Words.end());
+    Command.insert(Command.end(), Args.begin(), Args.end());
+    return Command;
+}
+
+bool SystemIncludesDetector::isClang()
+try {
+    using namespace subprocess;
+
+    if (!CxxIsClang) {
+        auto P = Popen(getCommand({ "--version" }), input { PIPE }, output { PIPE }, error { PIPE });
+        auto Out = P.communicate("", 0).first;
+        CxxIsClang = P.retcode() == 0 && StringRef(Out.string()).contains("clang");
+    }
+    return *CxxIsClang;
+} catch (const subprocess::CalledProcessError&) {
+    CxxIsClang = false;
+    return false;
+}
+
+std::vector<std::string> SystemIncludesDetector::probe(const std::vector<std::string>& Flags) const
+try {
+    using namespace subprocess;
+
+    auto Args = Flags;
+    Args.insert(Args.end(), { "-E", "-xc++", "-Wp,-v", "-" });
+    auto P = Popen(getCommand(Args), input { PIPE }, output { PIPE }, error { PIPE });
+    auto Out = P.communicate("", 0).second;
+    if (P.retcode() != 0) {
+        throw DetectSystemIncludesError(Out.string());
+    }
+
+    const auto Lines = Out.string();
+    auto R = llvm::split(Lines, '\n');
+    auto It = std::find_if(R.begin(), R.end(), [](const auto& L) { return L.startswith("#include <"); });
+    if (It == R.end() || ++It == R.end()) {
+        throw DetectSystemIncludesError("empty include directories");
+    }
+
+    std::vector<std::string> SystemIncludes;
+    for (auto L : llvm::make_range(It, R.end())) {
+        if (L.starts_with("End of search list")) {
+            break;
+        }
+        if (L.contains("(framework directory)")) {
+            continue;
+        }
+
+        SystemIncludes.push_back(L.drop_while([](const char C) { return std::isspace(C); }).str());
+    }
+    return SystemIncludes;
+} catch (const subprocess::CalledProcessError& E) {
+    throw DetectSystemIncludesError(E.what());
+}
+
+void SystemIncludesDetector::loadCacheFile()
+{
+    if (CacheFile.empty()) {
+        return;
+    }
+
+    auto Buffer = llvm::MemoryBuffer::getFile(CacheFile);
+    if (!Buffer) {
+        return;
+    }
+
+    auto Json = llvm::json::parse((*Buffer)->getBuffer());
+    if (!Json) {
+        // A broken cache is simply rebuilt
+        llvm::consumeError(Json.takeError());
+        return;
+    }
+
+    const auto* Entries = Json->getAsObject();
+    if (!Entries) {
+        return;
+    }
+
+    for (const auto& E : *Entries) {
+        const auto* Arr = E.second.getAsArray();
+        if (!Arr) {
+            continue;
+        }
+
+        std::vector<std::string> Includes;
+        for (const auto& D : *Arr) {
+            if (auto S = D.getAsString()) {
+                Includes.push_back(S->str());
+            }
+        }
+        Cache.emplace(StringRef(E.first).str(), std::move(Includes));
+    }
+}
+
+void SystemIncludesDetector::saveCacheFile() const
+{
+    if (CacheFile.empty()) {
+        return;
+    }
+
+    llvm::json::Object Entries;
+    for (const auto& [Key, Includes] : Cache) {
+        Entries[Key] = llvm::json::Array(Includes);
+    }
+
+    // writeToOutput writes to a temporary file first, concurrent runs never see a partial cache
+    auto Err = llvm::writeToOutput(CacheFile, [&Entries](llvm::raw_ostream& OS) {
+        OS << llvm::json::Value(std::move(Entries));
+        return llvm::Error::success();
+    });
+    if (Err) {
+        llvm::WithColor::warning() << "cannot write system includes cache " << CacheFile << ": "
+                                   << llvm::toString(std::move(Err)) << "\n";
+    }
+}
+
+} // namespace cppsafe
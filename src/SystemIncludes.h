@@ -0,0 +1,70 @@
+#pragma once
+
+#include "cppsafe/util/type.h"
+
+#include <clang/Tooling/ArgumentsAdjusters.h>
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace cppsafe {
+
+struct DetectSystemIncludesError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/// Detects the system include directories of the host compiler via `$CXX -E -xc++ -Wp,-v -`.
+///
+/// The result only depends on the compiler and on the few flags selecting the target, the sysroot
+/// and the standard library, so it is computed once per process for each distinct set of them
+/// instead of once per TU. Compilers other than clang reject some of these flags, e.g. `--target`,
+/// so they are probed without them. If a cache file is given, results are also persisted there, keyed
+/// by the compiler path and its modification time, so later runs skip the probe entirely.
+class SystemIncludesDetector {
+public:
+    SystemIncludesDetector(std::string Cxx, std::string CacheFile);
+
+    ~SystemIncludesDetector() = default;
+
+    DISALLOW_COPY_AND_MOVE(SystemIncludesDetector);
+
+    /// Appends the detected directories as `-idirafter` to a compile command, so that they are searched after
+    /// the resource headers of clang, e.g. its own stddef.h and intrinsics.
+    /// Thread-safe, the probe for a given key runs at most once.
+    /// \throws DetectSystemIncludesError
+    clang::tooling::CommandLineArguments adjust(clang::tooling::CommandLineArguments Args);
+
+private:
+    const std::vector<std::string>& detect(const std::vector<std::string>& Flags);
+
+    std::string makeKey(const std::vector<std::string>& Flags) const;
+
+    /// The command line running CXX with \p Args.
+    std::vector<std::string> getCommand(const std::vector<std::string>& Args) const;
+
+    /// Whether CXX is clang, which accepts all flags of the key. Probed once, with the lock held.
+    bool isClang();
+
+    std::vector<std::string> probe(const std::vector<std::string>& Flags) const;
+
+    void loadCacheFile();
+
+    void saveCacheFile() const;
+
+private:
+    std::string Cxx;
+    std::string CacheFile;
+    /// Identifies the compiler binary, so that upgrading it invalidates the cache file.
+    std::string CxxStamp;
+
+    std::mutex Mutex;
+    bool CacheFileLoaded = false;
+    std::optional<bool> CxxIsClang;
+    std::map<std::string, std::vector<std::string>> Cache;
+};
+
+}
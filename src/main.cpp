@@ -1,31 +1,61 @@
 #include "cppsafe/AstConsumer.h"
+#include "cppsafe/ChangedLines.h"
+#include "cppsafe/FunctionCache.h"
+#include "cppsafe/FunctionRegistry.h"
 #include "cppsafe/Options.h"
 
+#include "AstFile.h"
+#include "Report.h"
+#include "ResultCache.h"
+#include "Server.h"
+#include "Shard.h"
+#include "SystemIncludes.h"
+
 #include <clang/AST/ASTConsumer.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/FileManager.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
-#include <clang/Lex/HeaderSearchOptions.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
 #include <clang/Tooling/ArgumentsAdjusters.h>
 #include <clang/Tooling/CommonOptionsParser.h>
+#include <clang/Tooling/CompilationDatabase.h>
 #include <clang/Tooling/Tooling.h>
-#include <cpp-subprocess/subprocess.hpp>
 #include <fmt/core.h>
-#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
-#include <llvm/ADT/iterator_range.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/Regex.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include <algorithm>
-#include <cctype>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
-#include <functional>
+#include <iostream>
 #include <memory>
-#include <stdexcept>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <system_error>
+#include <utility>
 #include <vector>
 
 using namespace clang::tooling;
@@ -62,81 +92,601 @@ static const cl::opt<bool> WarnLifetimeDisabled("Wlifetime-disabled",
 static const cl::opt<bool> WarnLifetimeOutput("Wlifetime-output",
     desc("Enforce output parameter validity check in all paths"), cl::init(false), cl::cat(CppSafeCategory));
 
-struct DetectSystemIncludesError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
+static const cl::opt<unsigned> FunctionTimeBudget("function-time-budget",
+    desc("Milliseconds the analysis of a function may take. Beyond it, the psets still changing in a loop become "
+         "unknown, and beyond twice of it, the rest of the function is skipped, both with a remark. 0 means no limit"),
+    cl::init(0), cl::cat(CppSafeCategory));
+
+static const cl::opt<unsigned> MaxBlockVisits("max-block-visits",
+    desc("Number of CFG block visits the analysis of a function may take, handled like --function-time-budget, "
+         "so a function is skipped after twice as many visits. 0 means no limit"),
+    cl::init(100000), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> HeaderFilter("header-filter",
+    desc("Regular expression matching the headers whose functions are analyzed. Functions of the main file are "
+         "always analyzed. If not set, all headers except system headers are analyzed"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> ExcludePath("exclude-path",
+    desc("Regular expression matching files whose functions are never analyzed"), cl::init(""),
+    cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> Diff("diff",
+    desc("Unified diff, e.g. of `git diff`, or - for stdin. Only functions overlapping its changed lines are "
+         "analyzed, and sources it does not touch are not parsed unless it touches a header"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<bool> Serve("serve",
+    desc("Serve `check` requests of editors as JSON-RPC over stdin/stdout instead of analyzing the sources. Parsed "
+         "files and the diagnostics of their functions are kept, so a re-check only analyzes the edited functions"),
+    cl::init(false), cl::cat(CppSafeCategory));
+
+static const cl::opt<bool> AnalyzeHeadersOnce("analyze-headers-once",
+    desc("Report warnings of inline functions and template instantiations of headers only for the first source "
+         "including them. Sequential runs analyze them only there, runs with -j, --cache-dir and the like analyze "
+         "them in every source and drop the warnings reported by an earlier source"),
+    cl::init(true), cl::cat(CppSafeCategory));
+
+static const cl::opt<unsigned> Jobs("j",
+    desc("Number of translation units analyzed concurrently, 0 means all cores. Diagnostics are still printed in "
+         "the order of the source files"),
+    cl::init(1), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> SystemIncludesCache("system-includes-cache",
+    desc("File to persist the detected system include directories across runs"), cl::init(""),
+    cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> ShardOption("shard",
+    desc("Analyze only the i-th of n deterministic partitions of the sources, as i/n with 0 <= i < n"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> ShardCosts("shard-costs",
+    desc("Result file of a previous run, used to balance shards by the analysis time of each file instead of "
+         "by hash"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> ResultFile("result-file",
+    desc("Write diagnostics and timing of every file to a JSON file, which can be combined by `cppsafe merge`"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<std::string> AstDir("ast-dir",
+    desc("Directory of serialized ASTs written by `clang -emit-ast`, named after the sources with the extension "
+         "replaced by .ast. A source whose AST is up to date is analyzed without parsing it"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<bool> EmitAst("emit-ast",
+    desc("Write the serialized AST of every source to --ast-dir instead of analyzing it, built by the clang that "
+         "cppsafe uses, e.g. when the build does not run clang"),
+    cl::init(false), cl::cat(CppSafeCategory));
+
+static const cl::opt<bool> RequireAst("require-ast",
+    desc("Fail a source instead of parsing it when --ast-dir has no up-to-date AST of it"), cl::init(false),
+    cl::cat(CppSafeCategory));
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static cl::SubCommand MergeCommand("merge", "Merge result files of sharded runs into one report");
+
+static const cl::list<std::string> MergeInputs(
+    cl::Positional, desc("<result files>"), cl::OneOrMore, cl::sub(MergeCommand));
+
+static const cl::opt<std::string> MergeOutput(
+    "o", desc("Write the merged result file"), cl::init(""), cl::sub(MergeCommand));
+
+static const cl::opt<std::string> CacheDir("cache-dir",
+    desc("Directory to cache analysis results, keyed by the preprocessed source, the compiler arguments and the "
+         "cppsafe options. Unchanged files are not analyzed again"),
+    cl::init(""), cl::cat(CppSafeCategory));
+
+static const cl::opt<unsigned> CacheMaxSize("cache-max-size",
+    desc("Maximum size of --cache-dir in MiB, least recently used results are evicted"), cl::init(1024),
+    cl::cat(CppSafeCategory));
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables): set once from --diff before any analysis
+static std::shared_ptr<const ChangedLines> ChangedLinesOfDiff;
+
+static CppsafeOptions getCppsafeOptions()
+{
+    return {
+        .LifetimeMove = WarnLifetimeMove,
+        .LifetimeNull = WarnLifetimeNull,
+        .LifetimeCallNull = WarnLifetimeNull && !WarnNoLifetimeCallNull,
+        .LifetimePost = WarnLifetimePost,
+        .LifetimeDisabled = WarnLifetimeDisabled,
+        .LifetimeGlobal = WarnLifetimeGlobal,
+        .LifetimeOutput = WarnLifetimeOutput,
+        .FunctionTimeBudget = FunctionTimeBudget,
+        .MaxBlockVisits = MaxBlockVisits,
+        .HeaderFilter = HeaderFilter,
+        .ExcludePath = ExcludePath,
+        .Changed = ChangedLinesOfDiff,
+    };
+}
 
 class LifetimeFrontendAction : public clang::ASTFrontendAction {
 public:
-    LifetimeFrontendAction()
-    try {
-        using namespace subprocess;
+    LifetimeFrontendAction(FunctionCache* FnCache, FunctionRegistry* Registry)
+        : FnCache(FnCache)
+        , Registry(Registry)
+    {
+    }
 
-        const auto* Cxx = std::invoke([] {
-            // NOLINTNEXTLINE(concurrency-mt-unsafe): used only once
-            if (const auto* Cxx = std::getenv("CXX")) {
-                return Cxx;
-            }
+    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance&, llvm::StringRef) override
+    {
+        return std::make_unique<AstConsumer>(getCppsafeOptions(), FnCache, Registry);
+    }
 
-            return "c++";
-        });
+private:
+    FunctionCache* FnCache;
+    FunctionRegistry* Registry;
+};
+
+class LifetimeFrontendActionFactory : public FrontendActionFactory {
+public:
+    /// \param Quiet whether the compiler does not print "N warnings generated." itself, see printDiagnosticStats()
+    LifetimeFrontendActionFactory(FunctionCache* FnCache, FunctionRegistry* Registry, bool Quiet = false)
+        : FnCache(FnCache)
+        , Registry(Registry)
+        , Quiet(Quiet)
+    {
+    }
+
+    std::unique_ptr<clang::FrontendAction> create() override
+    {
+        return std::make_unique<LifetimeFrontendAction>(FnCache, Registry);
+    }
+
+    bool runInvocation(std::shared_ptr<clang::CompilerInvocation> Invocation, clang::FileManager* Files,
+        std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps,
+        clang::DiagnosticConsumer* DiagConsumer) override
+    {
+        if (!Quiet) {
+            return FrontendActionFactory::runInvocation(
+                std::move(Invocation), Files, std::move(PCHContainerOps), DiagConsumer);
+        }
+
+        // Same as FrontendActionFactory::runInvocation, which does not expose the compiler to redirect its output
+        clang::CompilerInstance Compiler(std::move(PCHContainerOps));
+        Compiler.setInvocation(std::move(Invocation));
+        Compiler.setFileManager(Files);
+        Compiler.setVerboseOutputStream(llvm::nulls());
+
+        // The action may refer to the compiler, so it is destroyed first
+        const std::unique_ptr<clang::FrontendAction> Action(create());
+
+        Compiler.createDiagnostics(DiagConsumer, /*ShouldOwnClient=*/false);
+        if (!Compiler.hasDiagnostics()) {
+            return false;
+        }
+        Compiler.createSourceManager(*Files);
+
+        const bool Success = Compiler.ExecuteAction(*Action);
+        Files->clearStatCache();
+        return Success;
+    }
+
+private:
+    FunctionCache* FnCache;
+    FunctionRegistry* Registry;
+    bool Quiet;
+};
+
+/// Writes the AST of a source to a directory, like `clang -emit-ast`.
+class EmitAstAction : public clang::GeneratePCHAction {
+public:
+    explicit EmitAstAction(std::string Dir)
+        : Dir(std::move(Dir))
+    {
+    }
 
-        auto P = Popen(fmt::format("{} -E -xc++ -Wp,-v -", Cxx), input { PIPE }, output { PIPE }, error { PIPE });
-        auto Out = P.communicate("", 0).second;
-        if (P.retcode() != 0) {
-            throw DetectSystemIncludesError(Out.string());
+protected:
+    bool BeginInvocation(clang::CompilerInstance& CI) override
+    {
+        auto& Opts = CI.getFrontendOpts();
+        Opts.OutputFile = getAstPath(Dir, Opts.Inputs.front().getFile());
+        return GeneratePCHAction::BeginInvocation(CI);
+    }
+
+private:
+    std::string Dir;
+};
+
+class EmitAstActionFactory : public FrontendActionFactory {
+public:
+    explicit EmitAstActionFactory(std::string Dir)
+        : Dir(std::move(Dir))
+    {
+    }
+
+    std::unique_ptr<clang::FrontendAction> create() override { return std::make_unique<EmitAstAction>(Dir); }
+
+private:
+    std::string Dir;
+};
+
+static CommandLineArguments addCppsafeDefine(CommandLineArguments Args, StringRef /*Filename*/)
+{
+    Args.push_back(fmt::format("-D__CPPSAFE__={}", CPPSAFE_VERSION));
+    return Args;
+}
+
+static ArgumentsAdjuster getCppsafeAdjuster(SystemIncludesDetector& Detector)
+{
+    return combineAdjusters(
+        addCppsafeDefine, [&Detector](const CommandLineArguments& Args, StringRef) { return Detector.adjust(Args); });
+}
+
+static void appendArgumentsAdjusters(ClangTool& Tool, SystemIncludesDetector& Detector)
+{
+    Tool.appendArgumentsAdjuster(getCppsafeAdjuster(Detector));
+}
+
+static std::unique_ptr<ClangTool> makeTool(
+    const CompilationDatabase& Compilations, const std::string& Source, SystemIncludesDetector& Detector)
+{
+    // The real file system links its working directory to the process, which is shared by all workers
+    auto Tool = std::make_unique<ClangTool>(Compilations, Source, std::make_shared<clang::PCHContainerOperations>(),
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>(llvm::vfs::createPhysicalFileSystem().release()));
+    appendArgumentsAdjusters(*Tool, Detector);
+    return Tool;
+}
+
+/// Diagnostics of a TU as they would be printed.
+struct PrintedDiags {
+    std::string Output;
+    /// Where each diagnostic of TUReport::Diags starts in Output
+    std::vector<unsigned> Offsets;
+};
+
+/// Analyze a single source, or replay its result from the cache.
+static PrintedDiags analyzeSource(const CompilationDatabase& Compilations, const std::string& Source,
+    SystemIncludesDetector& Detector, ResultCache* Cache, TUReport& TU)
+{
+    const auto Start = std::chrono::steady_clock::now();
+    const bool ShowColors = llvm::errs().has_colors();
+
+    std::optional<ResultKey> Key;
+    if (Cache) {
+        try {
+            Key = computeResultKey(*makeTool(Compilations, Source, Detector), getCppsafeOptions(), ShowColors);
+        } catch (const DetectSystemIncludesError&) {
+            // Reported by the analysis below
         }
 
-        const auto Lines = Out.string();
-        auto R = split(Lines, '\n');
-        auto It = std::find_if(R.begin(), R.end(), [](const auto& L) { return L.startswith("#include <"); });
-        if (It == R.end() || ++It == R.end()) {
-            throw DetectSystemIncludesError("empty include directories");
+        if (!Key) {
+            Cache->noteUncacheable();
+        } else if (auto Hit = Cache->lookup(Key->Content)) {
+            // The time of the analysis that produced the entry, so that --shard-costs still sees the real costs
+            TU.Seconds = Hit->TU.Seconds;
+            TU.ReturnCode = Hit->TU.ReturnCode;
+            TU.Diags = std::move(Hit->TU.Diags);
+            return { .Output = std::move(Hit->Output), .Offsets = std::move(Hit->DiagOffsets) };
         }
+    }
+
+    // Even if the TU changed, most of its functions usually did not
+    std::unique_ptr<FunctionCache> FnCache;
+    if (Key) {
+        FnCache = std::make_unique<FunctionCache>(Cache->getFunctionCachePath(Key->Command));
+    }
+    // Which TU claims a header function would depend on the scheduling and on the cache hits, so every TU analyzes
+    // all its functions, and runPerFile drops the warnings reported before
+    // The compiler would print "N warnings generated." from the worker thread, runPerFile prints it in order
+    LifetimeFrontendActionFactory Factory(FnCache.get(), nullptr, /*Quiet=*/true);
+
+    PrintedDiags Printed;
+    {
+        llvm::raw_string_ostream OS(Printed.Output);
+        const llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts = new clang::DiagnosticOptions();
+        DiagOpts->ShowColors = ShowColors;
+        clang::TextDiagnosticPrinter Printer(OS, DiagOpts.get());
+        RecordingDiagConsumer Recorder(Printer, TU.Diags, &Printed.Output, &Printed.Offsets);
 
-        for (auto L : make_range(It, R.end())) {
-            if (L.starts_with("End of search list")) {
-                break;
+        std::optional<int> AstReturnCode;
+        if (!AstDir.empty()) {
+            AstReturnCode = analyzeAstFile(getAstPath(AstDir, Source), getAbsolutePath(Source), getCppsafeOptions(),
+                FnCache.get(), nullptr, Recorder);
+            if (!AstReturnCode && RequireAst) {
+                OS << "error: no up-to-date AST of " << Source << " in " << AstDir << "\n";
+                AstReturnCode = EXIT_FAILURE;
             }
-            if (L.contains("(framework directory)")) {
-                continue;
+        }
+
+        if (AstReturnCode) {
+            TU.ReturnCode = *AstReturnCode;
+        } else {
+            const auto Tool = makeTool(Compilations, Source, Detector);
+            Tool->setDiagnosticConsumer(&Recorder);
+
+            try {
+                TU.ReturnCode = Tool->run(&Factory);
+            } catch (const DetectSystemIncludesError& E) {
+                OS << "error: Cannot find standard includes:" << E.what() << "\n";
+                TU.ReturnCode = EXIT_FAILURE;
             }
+        }
+    }
 
-            SystemIncludes.push_back(L.drop_while([](const char C) { return std::isspace(C); }).str());
+    TU.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    if (Key) {
+        FnCache->save();
+        Cache->noteFunctions(FnCache->getHits(), FnCache->getMisses());
+        // How far a function over its budget got depends on the machine and its load
+        if (!FnCache->hasBudgetExceeded()) {
+            Cache->store(Key->Content, { .Output = Printed.Output, .DiagOffsets = Printed.Offsets, .TU = TU });
         }
-    } catch (const subprocess::CalledProcessError& E) {
-        throw DetectSystemIncludesError(E.what());
     }
 
-    bool PrepareToExecuteAction(clang::CompilerInstance& CI) override
-    {
-        auto& Opts = CI.getHeaderSearchOpts();
-        if (Opts.UseStandardSystemIncludes) {
-            for (const auto& D : SystemIncludes) {
-                Opts.AddPath(D, clang::frontend::IncludeDirGroup::System, false, true);
+    return Printed;
+}
+
+/// Write the ASTs of \p Sources to --ast-dir. They are built by the clang cppsafe links, so they can be loaded.
+static int emitAstFiles(
+    const CompilationDatabase& Compilations, const std::vector<std::string>& Sources, SystemIncludesDetector& Detector)
+{
+    // The tool runs in the directory of each compile command
+    SmallString<256> Dir(AstDir.getValue());
+    std::error_code EC = llvm::sys::fs::make_absolute(Dir);
+    if (!EC) {
+        EC = llvm::sys::fs::create_directories(Dir);
+    }
+    if (EC) {
+        llvm::WithColor::error() << "cannot create " << AstDir << ": " << EC.message() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    ClangTool Tool(Compilations, Sources);
+    appendArgumentsAdjusters(Tool, Detector);
+
+    try {
+        EmitAstActionFactory Factory(Dir.str().str());
+        return Tool.run(&Factory);
+    } catch (const DetectSystemIncludesError& E) {
+        llvm::WithColor::error() << "Cannot find standard includes:" << E.what();
+    }
+
+    return EXIT_FAILURE;
+}
+
+/// Print "N warnings generated." for the diagnostics of \p TU, as the compiler does after each TU.
+static void printDiagnosticStats(const TUReport& TU, llvm::raw_ostream& OS)
+{
+    const auto NumWarnings = llvm::count_if(TU.Diags, [](const DiagRecord& D) { return D.Level == "warning"; });
+    const auto NumErrors = llvm::count_if(
+        TU.Diags, [](const DiagRecord& D) { return D.Level == "error" || D.Level == "fatal error"; });
+    if (NumWarnings == 0 && NumErrors == 0) {
+        return;
+    }
+
+    if (NumWarnings != 0) {
+        OS << NumWarnings << " warning" << (NumWarnings == 1 ? "" : "s");
+    }
+    if (NumWarnings != 0 && NumErrors != 0) {
+        OS << " and ";
+    }
+    if (NumErrors != 0) {
+        OS << NumErrors << " error" << (NumErrors == 1 ? "" : "s");
+    }
+    OS << " generated.\n";
+}
+
+/// Print the diagnostics of \p TU except the lifetime warnings an earlier TU reported, e.g. in a header both include,
+/// and drop those from \p TU.
+static void printUnreported(
+    const PrintedDiags& Printed, TUReport& TU, std::set<DiagKey>& Reported, llvm::raw_ostream& OS)
+{
+    const StringRef Output = Printed.Output;
+    const auto& Offsets = Printed.Offsets;
+    if (Offsets.size() != TU.Diags.size()) {
+        OS << Output;
+        return;
+    }
+
+    // Text before the first diagnostic is not printed by the analysis, e.g. missing system includes
+    OS << Output.take_front(Offsets.empty() ? Output.size() : Offsets.front());
+
+    std::vector<DiagKey> Keys;
+    std::vector<DiagRecord> Kept;
+    for (std::size_t I = 0; I < TU.Diags.size(); ++I) {
+        const bool Once = isReportedOnce(TU.Diags[I]);
+        auto Key = Once ? getDiagKey(TU.Diags[I]) : DiagKey {};
+        if (!Once || !Reported.contains(Key)) {
+            const auto End = I + 1 < Offsets.size() ? Offsets[I + 1] : Output.size();
+            OS << Output.slice(Offsets[I], End);
+            Kept.push_back(std::move(TU.Diags[I]));
+        }
+        if (Once) {
+            Keys.push_back(std::move(Key));
+        }
+    }
+
+    // Repeated diagnostics within a TU, e.g. of several instantiations, are all kept
+    Reported.insert(Keys.begin(), Keys.end());
+    TU.Diags = std::move(Kept);
+}
+
+/// Analyze every source in its own ClangTool on a thread pool.
+/// Diagnostics of a TU are buffered and flushed as soon as all TUs before it are done,
+/// so the output is identical to a sequential run.
+/// \param ReportOnce drop diagnostics already reported by an earlier TU, see --analyze-headers-once
+static int runPerFile(const CompilationDatabase& Compilations, const std::vector<std::string>& Sources,
+    SystemIncludesDetector& Detector, ResultCache* Cache, bool ReportOnce, unsigned NumJobs,
+    std::vector<TUReport>& Reports)
+{
+    struct TUResult {
+        PrintedDiags Printed;
+        bool Done = false;
+    };
+
+    std::vector<TUResult> Results(Sources.size());
+    Reports.assign(Sources.size(), {});
+    std::mutex Mutex;
+    std::size_t NextToPrint = 0;
+    std::set<DiagKey> Reported;
+
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumJobs));
+    for (std::size_t I = 0; I < Sources.size(); ++I) {
+        Pool.async([&, I] {
+            auto& TU = Reports[I];
+            TU.File = Sources[I];
+
+            auto Printed = analyzeSource(Compilations, Sources[I], Detector, Cache, TU);
+
+            const std::lock_guard Lock(Mutex);
+            Results[I].Printed = std::move(Printed);
+            Results[I].Done = true;
+            for (; NextToPrint < Results.size() && Results[NextToPrint].Done; ++NextToPrint) {
+                auto& Next = Results[NextToPrint].Printed;
+                if (ReportOnce) {
+                    printUnreported(Next, Reports[NextToPrint], Reported, llvm::errs());
+                } else {
+                    llvm::errs() << Next.Output;
+                }
+                printDiagnosticStats(Reports[NextToPrint], llvm::errs());
+                Next = {};
             }
+        });
+    }
+    Pool.wait();
+
+    // Same convention as ClangTool::run: 1 for errors, 2 if some files were skipped.
+    int Ret = 0;
+    for (const auto& TU : Reports) {
+        Ret = std::max(Ret, TU.ReturnCode);
+    }
+    return Ret;
+}
+
+static int runMerge()
+{
+    std::vector<Report> Reports;
+    for (const auto& Path : MergeInputs) {
+        auto R = readReport(Path);
+        if (!R) {
+            llvm::WithColor::error() << llvm::toString(R.takeError()) << "\n";
+            return EXIT_FAILURE;
         }
-        return true;
+        Reports.push_back(std::move(*R));
     }
 
-    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance&, llvm::StringRef) override
-    {
-        const CppsafeOptions Options {
-            .LifetimeMove = WarnLifetimeMove,
-            .LifetimeNull = WarnLifetimeNull,
-            .LifetimeCallNull = WarnLifetimeNull && !WarnNoLifetimeCallNull,
-            .LifetimePost = WarnLifetimePost,
-            .LifetimeDisabled = WarnLifetimeDisabled,
-            .LifetimeGlobal = WarnLifetimeGlobal,
-            .LifetimeOutput = WarnLifetimeOutput,
-        };
+    const auto Merged = mergeReports(Reports);
 
-        return std::make_unique<AstConsumer>(Options);
+    int Ret = 0;
+    double Seconds = 0;
+    std::size_t NumDiags = 0;
+    for (const auto& TU : Merged.TUs) {
+        printDiags(TU, llvm::outs());
+        Ret = std::max(Ret, TU.ReturnCode);
+        Seconds += TU.Seconds;
+        NumDiags += TU.Diags.size();
     }
+    llvm::outs() << fmt::format(
+        "{} diagnostics in {} files, {:.1f}s of analysis\n", NumDiags, Merged.TUs.size(), Seconds);
 
-private:
-    std::vector<std::string> SystemIncludes;
-};
+    if (!MergeOutput.empty()) {
+        if (auto Err = writeReport(MergeOutput, Merged)) {
+            llvm::WithColor::error() << llvm::toString(std::move(Err)) << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    return Ret;
+}
+
+static llvm::Expected<std::vector<std::string>> getShardSources(const std::vector<std::string>& Sources)
+{
+    auto Shard = parseShardSpec(ShardOption);
+    if (!Shard) {
+        return Shard.takeError();
+    }
+
+    llvm::StringMap<double> Costs;
+    if (!ShardCosts.empty()) {
+        auto Previous = readReport(ShardCosts);
+        if (!Previous) {
+            return Previous.takeError();
+        }
+        for (const auto& TU : Previous->TUs) {
+            Costs[TU.File] = TU.Seconds;
+        }
+    }
+
+    return selectShard(Sources, *Shard, Costs);
+}
+
+static llvm::Expected<std::shared_ptr<const ChangedLines>> loadDiff()
+{
+    auto Buffer = llvm::MemoryBuffer::getFileOrSTDIN(Diff);
+    if (!Buffer) {
+        return llvm::createStringError(
+            Buffer.getError(), "cannot read --diff " + Diff.getValue() + ": " + Buffer.getError().message());
+    }
+
+    auto Changed = ChangedLines::parseUnifiedDiff(Buffer.get()->getBuffer());
+    if (!Changed) {
+        return Changed.takeError();
+    }
+    return std::make_shared<const ChangedLines>(std::move(*Changed));
+}
+
+/// Whether a changed file may be included by a source, unlike e.g. a README or a CMakeLists.txt.
+static bool isHeaderLike(StringRef Path)
+{
+    static constexpr auto HeaderExtensions = std::to_array<StringRef>({ ".h", ".hpp", ".hh", ".hxx", ".inc", ".ipp" });
+
+    const auto Ext = llvm::sys::path::extension(Path).lower();
+    return Ext.empty() || llvm::is_contained(HeaderExtensions, Ext);
+}
+
+/// Sources touched by the diff. If it touches a header, any source may include it, and all of them are parsed.
+static std::vector<std::string> getChangedSources(const std::vector<std::string>& Sources, const ChangedLines& Changed)
+{
+    std::vector<std::string> AbsoluteSources;
+    AbsoluteSources.reserve(Sources.size());
+    for (const auto& Source : Sources) {
+        AbsoluteSources.push_back(getAbsolutePath(Source));
+    }
+
+    for (const auto& Entry : Changed.getFiles()) {
+        const auto& Name = Entry.first;
+        if (isHeaderLike(Name)
+            && llvm::none_of(
+                AbsoluteSources, [&Name](const std::string& S) { return ChangedLines::matches(S, Name); })) {
+            return Sources;
+        }
+    }
+
+    std::vector<std::string> Result;
+    for (std::size_t I = 0; I < Sources.size(); ++I) {
+        if (Changed.find(AbsoluteSources[I]) != nullptr) {
+            Result.push_back(Sources[I]);
+        }
+    }
+    return Result;
+}
+
+static int runServer(CommonOptionsParser& OptionsParser, bool HasFixedCompilations, SystemIncludesDetector& Detector)
+{
+    // CommonOptionsParser loads no compilation database without sources, which `--serve` does not need.
+    // Without `--` or `-p`, the database of each file is looked up in its parent directories.
+    std::unique_ptr<CompilationDatabase> Loaded;
+    const CompilationDatabase* Compilations = nullptr;
+    const auto* BuildPath = static_cast<cl::opt<std::string>*>(cl::getRegisteredOptions().lookup("p"));
+    if (HasFixedCompilations || !OptionsParser.getSourcePathList().empty()) {
+        Compilations = &OptionsParser.getCompilations();
+    } else if (BuildPath != nullptr && !BuildPath->getValue().empty()) {
+        std::string Error;
+        Loaded = CompilationDatabase::autoDetectFromDirectory(BuildPath->getValue(), Error);
+        if (!Loaded) {
+            llvm::WithColor::error() << Error << "\n";
+            return EXIT_FAILURE;
+        }
+        Compilations = Loaded.get();
+    }
+
+    // stdout carries the replies, nothing else may be printed there
+    Server S(Compilations, getCppsafeAdjuster(Detector), getCppsafeOptions());
+    return S.run(std::cin, llvm::outs());
+}
 
 int main(int argc, const char** argv)
 {
@@ -145,6 +695,11 @@ int main(int argc, const char** argv)
 Extra args:
     cppsafe <cppsafe options> -- <compiler options>
     cppsafe --Wlifetime-disabled -- -std=c++20 -Wno-unused
+
+Sharding:
+    cppsafe --shard=0/2 --result-file=0.json -p build <sources>
+    cppsafe --shard=1/2 --result-file=1.json -p build <sources>
+    cppsafe merge -o all.json 0.json 1.json
 )");
 
     const llvm::InitLLVM _(argc, argv);
@@ -152,21 +707,111 @@ Extra args:
                           "crash backtrace.\n");
 
     const char* Overview = "C++ Core Guidelines Lifetime profile static analyzer";
-    auto OptionsParser = CommonOptionsParser::create(argc, argv, CppSafeCategory, llvm::cl::OneOrMore, Overview);
+    if (argc > 1 && StringRef(argv[1]) == MergeCommand.getName()) {
+        if (!cl::ParseCommandLineOptions(argc, argv, Overview)) {
+            return EXIT_FAILURE;
+        }
+        return runMerge();
+    }
+
+    // Checked before parsing, which drops everything after `--` from argv
+    const bool HasFixedCompilations
+        = llvm::any_of(llvm::ArrayRef(argv, argc), [](const char* Arg) { return StringRef(Arg) == "--"; });
+    auto OptionsParser = CommonOptionsParser::create(argc, argv, CppSafeCategory, llvm::cl::ZeroOrMore, Overview);
     if (!OptionsParser) {
         llvm::WithColor::error() << llvm::toString(OptionsParser.takeError());
         return 1;
     }
+    if (!Serve && OptionsParser->getSourcePathList().empty()) {
+        llvm::WithColor::error() << "no input files\n";
+        return 1;
+    }
+
+    for (const auto* Opt : { &HeaderFilter, &ExcludePath }) {
+        std::string Error;
+        if (!llvm::Regex(Opt->getValue()).isValid(Error)) {
+            llvm::WithColor::error() << "invalid --" << Opt->ArgStr << ": " << Error << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((EmitAst || RequireAst) && AstDir.empty()) {
+        llvm::WithColor::error() << "--" << (EmitAst ? EmitAst.ArgStr : RequireAst.ArgStr) << " requires --ast-dir\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!Diff.empty()) {
+        auto Changed = loadDiff();
+        if (!Changed) {
+            llvm::WithColor::error() << llvm::toString(Changed.takeError()) << "\n";
+            return EXIT_FAILURE;
+        }
+        ChangedLinesOfDiff = std::move(*Changed);
+    }
+
+    // NOLINTNEXTLINE(concurrency-mt-unsafe): read before any thread is started
+    const auto* Cxx = std::getenv("CXX");
+    SystemIncludesDetector Detector(Cxx ? Cxx : "c++", SystemIncludesCache);
+
+    if (Serve) {
+        return runServer(*OptionsParser, HasFixedCompilations, Detector);
+    }
+
+    auto Sources = OptionsParser->getSourcePathList();
+    if (ChangedLinesOfDiff) {
+        Sources = getChangedSources(Sources, *ChangedLinesOfDiff);
+        if (Sources.empty()) {
+            return EXIT_SUCCESS;
+        }
+    }
+    if (!ShardOption.empty()) {
+        auto Selected = getShardSources(Sources);
+        if (!Selected) {
+            llvm::WithColor::error() << llvm::toString(Selected.takeError()) << "\n";
+            return EXIT_FAILURE;
+        }
+        Sources = std::move(*Selected);
+    }
+
+    if (EmitAst) {
+        return emitAstFiles(OptionsParser->getCompilations(), Sources, Detector);
+    }
+
+    if (Jobs != 1 || !ResultFile.empty() || !ShardOption.empty() || !CacheDir.empty() || !AstDir.empty()) {
+        std::unique_ptr<ResultCache> Cache;
+        if (!CacheDir.empty()) {
+            Cache = std::make_unique<ResultCache>(CacheDir, std::uint64_t(CacheMaxSize) << 20U);
+        }
+
+        Report R { .Version = CPPSAFE_VERSION, .Shard = ShardOption, .TUs = {} };
+        const int Ret = runPerFile(
+            OptionsParser->getCompilations(), Sources, Detector, Cache.get(), AnalyzeHeadersOnce, Jobs, R.TUs);
+        if (Cache) {
+            Cache->prune();
+            Cache->printStats(llvm::errs());
+        }
+        if (!ResultFile.empty()) {
+            if (auto Err = writeReport(ResultFile, R)) {
+                llvm::WithColor::error() << llvm::toString(std::move(Err)) << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        return Ret;
+    }
+
+    // TUs run in order and are not cached, so the first source including a header function analyzes it
+    std::unique_ptr<FunctionRegistry> Registry;
+    if (AnalyzeHeadersOnce) {
+        Registry = std::make_unique<FunctionRegistry>();
+    }
 
-    ClangTool Tool(OptionsParser->getCompilations(), OptionsParser->getSourcePathList());
+    ClangTool Tool(OptionsParser->getCompilations(), Sources);
 
-    Tool.appendArgumentsAdjuster([](CommandLineArguments Args, StringRef) {
-        Args.push_back(fmt::format("-D__CPPSAFE__={}", CPPSAFE_VERSION));
-        return Args;
-    });
+    appendArgumentsAdjusters(Tool, Detector);
 
     try {
-        return Tool.run(newFrontendActionFactory<LifetimeFrontendAction>().get());
+        LifetimeFrontendActionFactory Factory(nullptr, Registry.get());
+        return Tool.run(&Factory);
     } catch (const DetectSystemIncludesError& E) {
         llvm::WithColor::error() << "Cannot find standard includes:" << E.what();
     }